@@ -20,7 +20,27 @@ Reference:
 #include <string.h>
 #include <math.h>
 #include "astro.h"
-#define MAXITER 20  /* max iteration for Secand Method */
+#define MAXITER 20  /* max iteration for Secand and Newton Method */
+#define NEWTON_SAFETY 10.0  /* margin on the estimated error of Newton */
+
+/*
+ * upper bounds of |f''/f'| in 1/day over 1900 - 2100, taken twice the
+ * largest value found by sampling every hour. The Moon's speed varies by
+ * about 30% over an anomalistic month, the Sun's by 7% over a year.
+ */
+#define MS_MAXCURV 0.08
+#define SUN_MAXCURV 0.0014
+
+/*
+ * upper bounds in days of the difference between the roots on the low
+ * fidelity and on the full series, twice the largest difference found by
+ * sampling every day from LOWERR_JDMIN to LOWERR_JDMAX. They do not hold
+ * outside that range.
+ */
+#define MS_LOWERR (12.0 / 86400)
+#define SUN_LOWERR (100.0 / 86400)
+#define LOWERR_JDMIN 2414989.5   /* 1899-12-01 */
+#define LOWERR_JDMAX 2488465.5   /* 2101-02-01 */
 
 /* solve the equation when function f(jd, angle) reaches zero by
  * Secand method
@@ -46,6 +66,231 @@ double rootbysecand(double (*f)(double , double),
     return -1;
 }
 
+/* solve f(x[k], angle[k]) = 0 for n independent roots at once by Newton's
+ * method.
+ *
+ * f gives the value and its time derivative from one evaluation of the
+ * series. All roots advance in lockstep, so each iteration evaluates f once
+ * for all roots that have not converged yet.
+ *
+ * Newton converges quadratically: the error left after a step dx is about
+ * K dx^2, and K is measured as |dx| / dx_prev^2 from the last two steps. A
+ * root is taken as soon as that estimate, with a safety factor, is below the
+ * tolerance in time, which saves the evaluation that would only confirm it.
+ * If maxcurv, a bound of |f''/f'|, is not 0, the error is at most
+ * maxcurv / 2 * dx^2, so a good start can be taken after the first step.
+ *
+ * hist, if not NULL, counts the roots by the evaluations they took, the
+ * last bucket holds all that took SOLVER_HIST - 1 or more.
+ */
+void rootbynewton_batch(void (*f)(const double *, const double *, size_t,
+                                  double *, double *),
+                        double maxcurv, const double *angle,
+                        const double *x0, size_t n, double precision,
+                        double *roots, long *hist)
+{
+    int iter;
+    size_t i, j, k, m, active;
+    size_t idx[EPOCH_BATCH];
+    double a[EPOCH_BATCH], x[EPOCH_BATCH], prev[EPOCH_BATCH];
+    double fx[EPOCH_BATCH], dfx[EPOCH_BATCH], dx, tol;
+
+    for (; n > 0; angle += m, x0 += m, roots += m, n -= m) {
+        m = (n > EPOCH_BATCH) ? EPOCH_BATCH : n;
+        for (k = 0; k < m; k++) {
+            idx[k] = k;
+            a[k] = angle[k];
+            x[k] = x0[k];
+            prev[k] = 0;
+            roots[k] = -1;
+        }
+
+        active = m;
+        for (iter = 0; iter < MAXITER && active > 0; iter++) {
+            (*f)(x, a, active, fx, dfx);
+
+            /* retire converged roots, step and compact the others */
+            for (i = 0, j = 0; i < active; i++) {
+                if (fabs(fx[i]) < precision) {
+                    roots[idx[i]] = x[i];
+                    if (hist)
+                        hist[(iter + 1 < SOLVER_HIST) ? iter + 1
+                                                      : SOLVER_HIST - 1]++;
+                    continue;
+                }
+
+                dx = fx[i] / dfx[i];
+                tol = precision / fabs(dfx[i]);
+                if ((maxcurv > 0
+                     && NEWTON_SAFETY * 0.5 * maxcurv * dx * dx < tol)
+                    || (prev[i] != 0 && NEWTON_SAFETY * fabs(dx) * dx * dx
+                                        < tol * prev[i] * prev[i])) {
+                    roots[idx[i]] = x[i] - dx;
+                    if (hist)
+                        hist[(iter + 1 < SOLVER_HIST) ? iter + 1
+                                                      : SOLVER_HIST - 1]++;
+                    continue;
+                }
+
+                idx[j] = idx[i];
+                a[j] = a[i];
+                x[j] = x[i] - dx;
+                prev[j] = dx;
+                j++;
+            }
+            active = j;
+        }
+
+        if (active > 0)
+            printf("debug in rootbynewton_batch: %zu not found after %d "
+                   "iterations \n", active, iter);
+    }
+}
+
+/* evaluation counters of the new moon and solar term searches */
+static __thread struct solverstats nm_stats, st_stats;
+
+static int fidelity = FIDELITY_MULTI;
+
+/*
+ * select FIDELITY_MULTI or FIDELITY_FULL for the event searches. Not thread
+ * safe, call it before computing anything in parallel.
+ *
+ * Return:
+ *     the previous fidelity
+ */
+int set_fidelity(int f)
+{
+    int old = fidelity;
+    fidelity = f;
+    return old;
+}
+
+
+/*
+ * describe the models and settings the event searches use, event dates found
+ * under different descriptions may differ
+ */
+int solver_config(char *buf, size_t len)
+{
+    return snprintf(buf, len, "LEA-406 VSOP87 fidelity %d vsoplow %g "
+                    "lowerr %g %g %.1f-%.1f", fidelity, VSOP_LOW_MIN,
+                    MS_LOWERR * 86400, SUN_LOWERR * 86400, LOWERR_JDMIN,
+                    LOWERR_JDMAX);
+}
+
+/* whether jd +/- err in JDTT may fall on different dates in timezone tz */
+static int nearmidnight(double jd, double err, double tz)
+{
+    double local;
+    GregorianDate g;
+
+    g = jd2g(jd);
+    local = jd + 0.5 + (tz * 3600.0 - deltaT(g.year, g.month)) / 86400.0;
+    return floor(local - err) != floor(local + err);
+}
+
+/*
+ * multi-fidelity Newton for roots whose dates in timezone tz are all that
+ * need to be exact.
+ *
+ * With lowerr not 0 the roots are solved on the low fidelity flow. A root is
+ * kept as it is unless it is within lowerr of local midnight, where the full
+ * series might put it on the other day. Those few are polished on ffull: the
+ * roots of flow are within seconds of the true ones, so a single full Newton
+ * step leaves an error of at most maxcurv / 2 * dx^2 for a step dx, where
+ * maxcurv bounds |f''/f'|. A root is taken after that one step when the
+ * bound, with a safety factor, is below the tolerance in time, the others
+ * continue Newton on ffull. stats->refined counts the roots solved on ffull.
+ *
+ * The seeds x0 converge on ffull after about one evaluation, so with lowerr
+ * 0, where every root must be exact, and with FIDELITY_FULL only ffull is
+ * used.
+ */
+static void rootbynewton_mf(void (*flow)(const double *, const double *,
+                                         size_t, double *, double *),
+                            void (*ffull)(const double *, const double *,
+                                          size_t, double *, double *),
+                            double maxcurv, double lowerr, double tz,
+                            struct solverstats *stats, const double *angle,
+                            const double *x0, size_t n, double precision,
+                            double *roots)
+{
+    size_t i, j, k, m, p;
+    size_t idx[EPOCH_BATCH], pidx[EPOCH_BATCH];
+    double a[EPOCH_BATCH], x[EPOCH_BATCH], r[EPOCH_BATCH];
+    double pa[EPOCH_BATCH], px[EPOCH_BATCH];
+    double fx[EPOCH_BATCH], dfx[EPOCH_BATCH], dx;
+
+    if (fidelity == FIDELITY_FULL || lowerr <= 0) {
+        rootbynewton_batch(ffull, maxcurv, angle, x0, n, precision, roots,
+                           stats->hist);
+        stats->refined += n;
+        return;
+    }
+
+    rootbynewton_batch(flow, maxcurv, angle, x0, n, precision, roots,
+                       stats->hist);
+
+    for (; n > 0; angle += m, roots += m, n -= m) {
+        m = (n > EPOCH_BATCH) ? EPOCH_BATCH : n;
+
+        /* pick the roots to polish */
+        for (k = 0, p = 0; k < m; k++) {
+            if (roots[k] > LOWERR_JDMIN && roots[k] < LOWERR_JDMAX
+                && !nearmidnight(roots[k], lowerr, tz))
+                continue;
+
+            pidx[p] = k;
+            pa[p] = angle[k];
+            px[p] = roots[k];
+            p++;
+        }
+        if (p == 0)
+            continue;
+
+        stats->refined += p;
+        (*ffull)(px, pa, p, fx, dfx);
+
+        for (k = 0, j = 0; k < p; k++) {
+            if (fabs(fx[k]) < precision)
+                continue;
+
+            dx = fx[k] / dfx[k];
+            roots[pidx[k]] -= dx;
+            if (NEWTON_SAFETY * 0.5 * maxcurv * dx * dx
+                < precision / fabs(dfx[k]))
+                continue;
+
+            idx[j] = pidx[k];
+            a[j] = pa[k];
+            x[j] = roots[pidx[k]];
+            j++;
+        }
+
+        if (j > 0) {
+            rootbynewton_batch(ffull, maxcurv, a, x, j, precision, r, NULL);
+            for (i = 0; i < j; i++)
+                roots[idx[i]] = r[i];
+        }
+    }
+}
+
+/* copy the counters of this thread, either pointer can be NULL */
+void get_solverstats(struct solverstats *nm, struct solverstats *st)
+{
+    if (nm)
+        *nm = nm_stats;
+    if (st)
+        *st = st_stats;
+}
+
+void reset_solverstats(void)
+{
+    memset(&nm_stats, 0, sizeof(nm_stats));
+    memset(&st_stats, 0, sizeof(st_stats));
+}
+
 /* covernt radian to 0 - 2pi */
 double normrad(double r) {
     r = fmod(r, TWOPI);
@@ -74,9 +319,34 @@ double npitopi(double r) {
  */
 double f_solarangle(double jd, double angle)
 {
+    st_stats.evals++;
     return npitopi(apparentsun(jd, 0) - angle);
 }
 
+/* f_solarangle for n epochs */
+void f_solarangle_batch(const double *jd, const double *angle, size_t n,
+                        double *out)
+{
+    size_t k;
+
+    st_stats.evals += n;
+    apparentsun_batch(jd, n, out, 0);
+    for (k = 0; k < n; k++)
+        out[k] = npitopi(out[k] - angle[k]);
+}
+
+/* f_solarangle and its rate in radians per day for n epochs */
+void f_solarangle_rate_batch(const double *jd, const double *angle, size_t n,
+                             double *out, double *rate)
+{
+    size_t k;
+
+    st_stats.evals += n;
+    apparentsun_rate_batch(jd, n, out, rate, 0);
+    for (k = 0; k < n; k++)
+        out[k] = npitopi(out[k] - angle[k]);
+}
+
 /* Calculate difference between target angle and current sun-moon angle
  *
  * Arg:
@@ -87,10 +357,78 @@ double f_solarangle(double jd, double angle)
  */
 double f_msangle(double jd, double angle)
 {
+    nm_stats.evals++;
     return npitopi(apparentmoon(jd, 1) - apparentsun(jd, 1) - angle);
 }
 
-/* calculate Solar Term by secand method
+/* f_msangle for n epochs */
+void f_msangle_batch(const double *jd, const double *angle, size_t n,
+                     double *out)
+{
+    size_t k, m;
+    double sun[EPOCH_BATCH];
+
+    nm_stats.evals += n;
+    for (; n > 0; jd += m, angle += m, out += m, n -= m) {
+        m = (n > EPOCH_BATCH) ? EPOCH_BATCH : n;
+        apparentmoon_batch(jd, m, out, 1);
+        apparentsun_batch(jd, m, sun, 1);
+        for (k = 0; k < m; k++)
+            out[k] = npitopi(out[k] - sun[k] - angle[k]);
+    }
+}
+
+/* f_solarangle_rate_batch by the low fidelity Sun */
+void f_solarangle_low_rate_batch(const double *jd, const double *angle,
+                                 size_t n, double *out, double *rate)
+{
+    size_t k;
+
+    st_stats.lowevals += n;
+    apparentsun_low_rate_batch(jd, n, out, rate, 0);
+    for (k = 0; k < n; k++)
+        out[k] = npitopi(out[k] - angle[k]);
+}
+
+/* f_msangle and its rate in radians per day for n epochs */
+void f_msangle_rate_batch(const double *jd, const double *angle, size_t n,
+                          double *out, double *rate)
+{
+    size_t k, m;
+    double sun[EPOCH_BATCH], sunrate[EPOCH_BATCH];
+
+    nm_stats.evals += n;
+    for (; n > 0; jd += m, angle += m, out += m, rate += m, n -= m) {
+        m = (n > EPOCH_BATCH) ? EPOCH_BATCH : n;
+        apparentmoon_rate_batch(jd, m, out, rate, 1);
+        apparentsun_rate_batch(jd, m, sun, sunrate, 1);
+        for (k = 0; k < m; k++) {
+            out[k] = npitopi(out[k] - sun[k] - angle[k]);
+            rate[k] -= sunrate[k];
+        }
+    }
+}
+
+/* f_msangle_rate_batch by the low fidelity Moon and Sun */
+void f_msangle_low_rate_batch(const double *jd, const double *angle, size_t n,
+                              double *out, double *rate)
+{
+    size_t k, m;
+    double sun[EPOCH_BATCH], sunrate[EPOCH_BATCH];
+
+    nm_stats.lowevals += n;
+    for (; n > 0; jd += m, angle += m, out += m, rate += m, n -= m) {
+        m = (n > EPOCH_BATCH) ? EPOCH_BATCH : n;
+        apparentmoon_low_rate_batch(jd, m, out, rate, 1);
+        apparentsun_low_rate_batch(jd, m, sun, sunrate, 1);
+        for (k = 0; k < m; k++) {
+            out[k] = npitopi(out[k] - sun[k] - angle[k]);
+            rate[k] -= sunrate[k];
+        }
+    }
+}
+
+/* calculate Solar Term by Newton's method
  *
  * The Sun's moving speed on ecliptical longitude is 0.04 argsecond / second,
  *
@@ -108,31 +446,107 @@ double solarterm(int year, double angle)
 {
     /* mean error when compare apparentsun to NASA(1900-2100) is 0.05"
      * 0.000000005 radians = 0.001" */
-    double ERROR, r, est_vejd, x0, x1;
+    double ERROR, r, x0, jd;
     ERROR = 0.000000005;
 
-    /* estimated date of Vernal Equinox, March 20.5 UTC0 */
-    est_vejd = g2jd(year, 3, 20.5);
-
     /* negative angle means search backward from Vernal Equinox.
-     * Initialize x0 to the day which apparent Sun longitude close to the
-     * angle we searching for */
-
-    x0 = est_vejd + angle * 360.0 / 365.24;
-    x1 = x0 + 0.5;
+     * Initialize x0 to the time the low accuracy Sun reaches the angle */
+    x0 = est_solarterm(year, angle);
 
     r = angle * DEG2RAD;
-    return rootbysecand(f_solarangle, r, x0, x1, ERROR);
+    rootbynewton_mf(f_solarangle_low_rate_batch, f_solarangle_rate_batch,
+                    SUN_MAXCURV, 0, 0, &st_stats, &r, &x0, 1, ERROR, &jd);
+    st_stats.events++;
+    return jd;
+}
+
+/* find solar terms of a year in one batch, see rootbynewton_mf for lowerr
+ * and tz */
+static void searchsolarterms(double jds[], const double angles[], int count,
+                             int year, double lowerr, double tz)
+{
+    int i;
+    double ERROR;
+    double r[count], x0[count];
+    ERROR = 0.000000005;
+
+    for (i = 0; i < count; i++) {
+        x0[i] = est_solarterm(year, angles[i]);
+        r[i] = angles[i] * DEG2RAD;
+    }
+
+    rootbynewton_mf(f_solarangle_low_rate_batch, f_solarangle_rate_batch,
+                    SUN_MAXCURV, lowerr, tz, &st_stats, r, x0, count, ERROR,
+                    jds);
+    st_stats.events += count;
+}
+
+/* find solar terms of a year in one batch
+ *
+ * Args:
+ *     jds: output, time in JDTT
+ *     angles: degrees of the solar terms
+ *     count: number of solar terms
+ *     year: the year in integer
+ */
+void findsolarterms(double jds[], const double angles[], int count, int year)
+{
+    searchsolarterms(jds, angles, count, year, 0, 0);
+}
+
+/*
+ * findsolarterms for a calendar, only the dates in timezone tz are exact.
+ * A solar term is refined on the full series only when it is within seconds
+ * of local midnight.
+ */
+void findsolarterms_date(double jds[], const double angles[], int count,
+                         int year, double tz)
+{
+    searchsolarterms(jds, angles, count, year, SUN_LOWERR, tz);
+}
+
+/*
+ * count solar terms in order from solar term number n0. Number n is the Sun
+ * at 15 * (n mod 24) degrees from the Vernal Equinox of year n / 24, rounded
+ * down. Only the dates in timezone tz are exact, as in findsolarterms_date.
+ */
+void findsolarterms_bynum_date(double jds[], long n0, int count, double tz)
+{
+    int i, year;
+    double angles[count];
+
+    year = (int) floor(n0 / 24.0);
+    for (i = 0; i < count; i++)
+        angles[i] = 15.0 * (n0 + i - 24L * year);
+
+    searchsolarterms(jds, angles, count, year, SUN_LOWERR, tz);
+}
+
+/*
+ * solar terms nums[0] ... nums[count - 1] in one batch, numbered as in
+ * findsolarterms_bynum_date. nums are in increasing order.
+ */
+void findsolarterms_bynums_date(double jds[], const long nums[], int count,
+                                double tz)
+{
+    int i, year;
+    double angles[count];
+
+    year = (int) floor(nums[0] / 24.0);
+    for (i = 0; i < count; i++)
+        angles[i] = 15.0 * (nums[i] - 24L * year);
+
+    searchsolarterms(jds, angles, count, year, SUN_LOWERR, tz);
 }
 
 /* search newmoon near a given date.
  *
  * Angle between Sun-Moon has been converted to {-pi, pi} range so the
- * function f_msangle is continuous in that range. Use Secand method to find
- * root.
+ * function f_msangle is continuous in that range. Use Newton's method to find
+ * root, the rate comes with the angle from the same evaluation.
  *
- * Test shows newmoon can be found in 5 iterations, if the start is close
- * enough, it may use only 3 iterations.
+ * Seeded by the mean new moon of Meeus, newmoon is usually found in one
+ * evaluation, the Secand method needed 5 or 6.
  *
  * Arg:
  *     jd: in JDTT
@@ -145,13 +559,49 @@ double newmoon(double jd)
 
     /* 0.0000001 radians is about 0.02 arcsecond, mean error of apparentmoon
      * when compared to JPL Horizon is about 0.7 arcsecond */
-    double ERROR, x0, x1;
+    double ERROR, zero, x0, nm;
     ERROR = 0.0000001;
 
-    /* initilize x0 to the day close to newmoon */
-    x0 = jd - f_msangle(jd, 0) / MOON_SPEED;
-    x1 = x0 + 0.5;
-    return rootbysecand(f_msangle, 0, x0, x1, ERROR);
+    zero = 0;
+    x0 = est_newmoon(jd);
+    rootbynewton_mf(f_msangle_low_rate_batch, f_msangle_rate_batch,
+                    MS_MAXCURV, 0, 0, &nm_stats, &zero, &x0, 1, ERROR, &nm);
+    nm_stats.events++;
+    return nm;
+}
+
+/* search the new moons of nmcount lunations from k, see rootbynewton_mf for
+ * lowerr and tz */
+static void searchlunations(double newmoons[], int nmcount, double k,
+                            double lowerr, double tz)
+{
+    int i;
+    double ERROR;
+    double zero[nmcount], est[nmcount];
+    ERROR = 0.0000001;
+
+    if (nmcount < 1)
+        return;
+
+    /* seed by the mean new moons, then refine all of them in one batch */
+    for (i = 0; i < nmcount; i++) {
+        zero[i] = 0;
+        est[i] = meeus_newmoon(k + i);
+    }
+
+    rootbynewton_mf(f_msangle_low_rate_batch, f_msangle_rate_batch,
+                    MS_MAXCURV, lowerr, tz, &nm_stats, zero, est, nmcount,
+                    ERROR, newmoons);
+    nm_stats.events += nmcount;
+}
+
+/* search new moons from startjd, see rootbynewton_mf for lowerr and tz */
+static void searchnewmoons(double newmoons[], int nmcount, double startjd,
+                           double lowerr, double tz)
+{
+    /* start from the lunation nearest to startjd */
+    searchlunations(newmoons, nmcount, lunation(est_newmoon(startjd)),
+                    lowerr, tz);
 }
 
 /* search new moon from specified start time
@@ -165,14 +615,50 @@ double newmoon(double jd)
  *
  */
 void findnewmoons(double newmoons[], int nmcount, double startjd)
+{
+    searchnewmoons(newmoons, nmcount, startjd, 0, 0);
+}
+
+/*
+ * findnewmoons for a calendar, only the dates in timezone tz are exact. A
+ * new moon is refined on the full series only when it is within seconds of
+ * local midnight.
+ */
+void findnewmoons_date(double newmoons[], int nmcount, double startjd,
+                       double tz)
+{
+    searchnewmoons(newmoons, nmcount, startjd, MS_LOWERR, tz);
+}
+
+/*
+ * new moons of count lunations from lunation k0, lunation 0 is the new moon
+ * of 2000-01-06. Only the dates in timezone tz are exact, as in
+ * findnewmoons_date.
+ */
+void findlunations_date(double jds[], long k0, int count, double tz)
+{
+    searchlunations(jds, count, (double) k0, MS_LOWERR, tz);
+}
+
+/* new moons of lunations ks[0] ... ks[count - 1] in one batch, as
+ * findlunations_date */
+void findlunations_bynums_date(double jds[], const long ks[], int count,
+                               double tz)
 {
     int i;
-    double nm;
-    for ( i = 0; i < nmcount; i++) {
-        nm = newmoon(startjd);
-        newmoons[i] = nm;
-        startjd = nm + SYNODIC_MONTH;
+    double ERROR;
+    double zero[count], est[count];
+    ERROR = 0.0000001;
+
+    for (i = 0; i < count; i++) {
+        zero[i] = 0;
+        est[i] = meeus_newmoon(ks[i]);
     }
+
+    rootbynewton_mf(f_msangle_low_rate_batch, f_msangle_rate_batch,
+                    MS_MAXCURV, MS_LOWERR, tz, &nm_stats, zero, est, count,
+                    ERROR, jds);
+    nm_stats.events += count;
 }
 
 /* convert decimal degree to d m s format string */
@@ -18,6 +18,15 @@
 #define ISODTLEN 30    /* max length of ISO date string */
 #define MAX_THREADS 32  /* max number of threads for compute lea406-full */
 #define MAX_CPUINFO_LEN 1000  /* max line buf size when parse /proc/cpuinfo */
+#define CACHELINE 64    /* pad per thread data to avoid false sharing */
+#define EPOCH_BATCH 32  /* max epochs a batch kernel evaluates in one pass */
+#define SOLVER_HIST 8   /* buckets of the solver iteration histogram */
+#define EVENT_WINDOW 64  /* events of each kind kept by an event stream */
+#define EVENT_AHEAD 24   /* min events computed in a batch by a stream */
+
+#define FIDELITY_MULTI 0  /* solve on truncated series, polish on full ones */
+#define FIDELITY_FULL 1   /* solve on the full series only */
+#define VSOP_LOW_MIN 0.000001  /* smallest amplitude in low fidelity VSOP87 */
 
 typedef struct {
     int year;
@@ -25,9 +34,58 @@ typedef struct {
     double day;
 } GregorianDate;
 
+/*
+ * LEA-406 table in structure of arrays layout for the term kernels.
+ *
+ * The three Poisson terms of a harmonic share the same argument, so
+ * A0 sin(arg + p0) + A1 tm sin(arg + p1) + A2 tm^2 sin(arg + p2) is kept as
+ * one phasor, S sin(arg) + C cos(arg), where S = sum Ak cos(pk) tm^k and
+ * C = sum Ak sin(pk) tm^k. A term then needs only one sincos.
+ */
+struct lea406_soa {
+    const double *arg0, *arg1, *arg2;   /* argument polynomial, in arcsec */
+    const double *s0, *s1, *s2;         /* Ak cos(pk), coefficient of sin */
+    const double *c0, *c1, *c2;         /* Ak sin(pk), coefficient of cos */
+};
+
+/* sum the terms from start up to end for n epochs, t in century, and the
+ * time derivatives in arcsec per century if rate is not NULL */
+typedef void (*lea406kernel)(const struct lea406_soa *tab, int start,
+                             int end, const double *t, size_t n, double *out,
+                             double *rate);
+
+/* how hard the root finder worked, kept per thread */
+struct solverstats {
+    long events;         /* roots found */
+    long evals;          /* epochs evaluated by the full models */
+    long lowevals;       /* epochs evaluated by the low fidelity models */
+    long refined;        /* roots polished on the full models */
+    long hist[SOLVER_HIST];  /* roots by evaluations the search took */
+};
+
 struct worker_param {
-    int tid;
-    double tc;           /* t in century */
+    int tid;             /* worker id, also index of its result slot */
+};
+
+/*
+ * New moons and solar terms in time order, each computed once. New moons
+ * are keyed by lunation number, solar terms by solar term number, see
+ * eventstream.c. A window of the most recent EVENT_WINDOW events of each
+ * kind is kept.
+ */
+struct eventstream {
+    double tz;           /* dates are exact in this timezone */
+    long nm_first;       /* lunation of nm[0] */
+    int nm_count;
+    long st_first;       /* solar term number of st[0] */
+    int st_count;
+    long computed;       /* events computed so far */
+    double nm[EVENT_WINDOW];   /* JDTT of new moons */
+    double st[EVENT_WINDOW];   /* JDTT of solar terms */
+    long nmsp_num[EVENT_WINDOW];  /* new moons solved by number, by k */
+    double nmsp[EVENT_WINDOW];
+    long stsp_num[EVENT_WINDOW];  /* solar terms solved by number, by n */
+    double stsp[EVENT_WINDOW];
 };
 
 /* Function prototypes */
@@ -49,10 +107,42 @@ double deltaT(int year, int month);
 
 double apparentsun(double jd, int ignorenutation);
 
+void apparentsun_batch(const double *jd, size_t n, double *out,
+                       int ignorenutation);
+
+void apparentsun_rate_batch(const double *jd, size_t n, double *out,
+                            double *rate, int ignorenutation);
+
+void apparentsun_low_rate_batch(const double *jd, size_t n, double *out,
+                                double *rate, int ignorenutation);
+
 double apparentmoon(double jd, int ignorenutation);
 
+void apparentmoon_batch(const double *jd, size_t n, double *out,
+                        int ignorenutation);
+
+void apparentmoon_rate_batch(const double *jd, size_t n, double *out,
+                             double *rate, int ignorenutation);
+
+void apparentmoon_low_rate_batch(const double *jd, size_t n, double *out,
+                                 double *rate, int ignorenutation);
+
 double lea406(double jd, int ignorenutation);
 
+void lea406_batch(const double *jd, size_t n, double *out);
+
+void lea406_rate_batch(const double *jd, size_t n, double *out, double *rate);
+
+void lea406_low_rate_batch(const double *jd, size_t n, double *out,
+                           double *rate);
+
+const char *lea406_use_kernel(const char *name);
+
+lea406kernel lea406kernel_find(const char *name, const char **found);
+
+void lea406kernel_scalar(const struct lea406_soa *tab, int start, int end,
+                         const double *t, size_t n, double *out, double *rate);
+
 void *lea406worker(void *args);
 
 double nutation(double jd);
@@ -61,21 +151,108 @@ double lightabbr_high(double jd);
 
 double vsopLx(double vsopterms[][3], size_t rowcount, double t);
 
+void vsopLx_batch(double vsopterms[][3], size_t rowcount, const double *t,
+                  size_t n, double *out);
+
+void vsopLx_rate_batch(double vsopterms[][3], size_t rowcount,
+                       const double *t, size_t n, double *out, double *rate);
+
 double vsop(double jd);
 
+void vsop_batch(const double *jd, size_t n, double *out);
+
+void vsop_rate_batch(const double *jd, size_t n, double *out, double *rate);
+
+void vsop_low_rate_batch(const double *jd, size_t n, double *out,
+                         double *rate);
+
 double rootbysecand(double (*f)(double , double),
                     double angle, double x0, double x1, double precision);
 
+void rootbynewton_batch(void (*f)(const double *, const double *, size_t,
+                                  double *, double *),
+                        double maxcurv, const double *angle,
+                        const double *x0, size_t n, double precision,
+                        double *roots, long *hist);
+
 double f_solarangle(double jd, double angle);
 
+void f_solarangle_batch(const double *jd, const double *angle, size_t n,
+                        double *out);
+
+void f_solarangle_rate_batch(const double *jd, const double *angle, size_t n,
+                             double *out, double *rate);
+
+void f_solarangle_low_rate_batch(const double *jd, const double *angle,
+                                 size_t n, double *out, double *rate);
+
 double f_msangle(double jd, double angle);
 
+void f_msangle_batch(const double *jd, const double *angle, size_t n,
+                     double *out);
+
+void f_msangle_rate_batch(const double *jd, const double *angle, size_t n,
+                          double *out, double *rate);
+
+void f_msangle_low_rate_batch(const double *jd, const double *angle, size_t n,
+                              double *out, double *rate);
+
+int set_fidelity(int f);
+
+int solver_config(char *buf, size_t len);
+
 double newmoon(double jd);
 
 void findnewmoons(double newmoons[], int nmcount, double startjd);
 
+void findnewmoons_date(double newmoons[], int nmcount, double startjd,
+                       double tz);
+
+void findlunations_date(double jds[], long k0, int count, double tz);
+
+void findlunations_bynums_date(double jds[], const long ks[], int count,
+                               double tz);
+
 double solarterm(int year, double angle);
 
+void findsolarterms(double jds[], const double angles[], int count, int year);
+
+void findsolarterms_date(double jds[], const double angles[], int count,
+                         int year, double tz);
+
+void findsolarterms_bynum_date(double jds[], long n0, int count, double tz);
+
+void findsolarterms_bynums_date(double jds[], const long nums[], int count,
+                                double tz);
+
 int findastro(int year);
 
+double lunation(double jd);
+
+double meeus_newmoon(double k);
+
+double est_newmoon(double jd);
+
+double meeus_apparentsun(double jd);
+
+double est_solarterm(int year, double angle);
+
+void eventstream_init(struct eventstream *s, double tz);
+
+double stream_newmoon(struct eventstream *s, long k);
+
+double stream_solarterm(struct eventstream *s, long n);
+
+void stream_newmoons(struct eventstream *s, const long nums[], int count,
+                     double jds[]);
+
+void stream_solarterms(struct eventstream *s, const long nums[], int count,
+                       double jds[]);
+
+long stream_winter_solstice(int year);
+
 int cpucount(void);
+
+void get_solverstats(struct solverstats *nm, struct solverstats *st);
+
+void reset_solverstats(void);
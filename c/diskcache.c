@@ -0,0 +1,225 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Persistent cache of computed lunar years.
+
+A year model holds the dates of every new moon and solar term the calendar
+uses, so a run that finds its years in the cache file does no astronomy at
+all. The file is mapped and its entries are used in place, nothing is
+parsed. There is one entry for each year from DISKCACHE_FIRST to
+DISKCACHE_LAST, found by the year number.
+
+The header records the file layout and solver_config(). A file written by a
+different version or configuration gets a new header and its old entries
+are ignored, because every entry checksum is seeded by the header checksum.
+Any other file that is not empty is never written to.
+
+Several processes and threads may share one file. A writer holds a mutex
+against the other threads of its process and a fcntl lock on the entry
+against other processes. It clears the checksum, writes the entry, then
+sets the checksum last. Readers take no lock, an entry whose checksum does
+not match is a miss.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "astro.h"
+#include "lunarcalbase.h"
+
+#define BYTEORDER 0x01020304
+
+
+/* FNV-1a hash of len bytes at p, continued from h */
+static unsigned int checksum(unsigned int h, const void *p, size_t len)
+{
+    const unsigned char *c = (const unsigned char *) p;
+
+    while (len--) {
+        h ^= *c++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+
+/* the header this process writes and accepts */
+static void fill_header(struct diskcache_header *h)
+{
+    memset(h, 0, sizeof(struct diskcache_header));
+    memcpy(h->magic, DISKCACHE_MAGIC, sizeof(h->magic));
+    h->version = DISKCACHE_VERSION;
+    h->byteorder = BYTEORDER;
+    h->entrysize = sizeof(struct diskcache_entry);
+    h->first = DISKCACHE_FIRST;
+    h->last = DISKCACHE_LAST;
+    solver_config(h->config, DISKCACHE_CONFIG);
+    h->checksum = checksum(2166136261u, h,
+                           offsetof(struct diskcache_header, checksum));
+}
+
+
+static unsigned int entry_checksum(const struct diskcache *dc, int year,
+                                   const struct lunaryear *ly)
+{
+    unsigned int h;
+
+    h = checksum(dc->seed, &year, sizeof(year));
+    h = checksum(h, ly, sizeof(struct lunaryear));
+    return h ? h : 1;    /* 0 marks an empty entry */
+}
+
+
+/* lock or unlock len bytes at start of fd, wait for other processes */
+static int lockrange(int fd, short type, off_t start, off_t len)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    return fcntl(fd, F_SETLKW, &fl);
+}
+
+
+/*
+ * open or create the cache file at path. A file that is neither empty nor a
+ * cache file is left as it is.
+ *
+ * Return: NULL on error, errno is EINVAL if path is not a cache file
+ */
+struct diskcache *diskcache_open(const char *path)
+{
+    int fd;
+    size_t size;
+    void *map;
+    struct stat st;
+    struct diskcache_header want, have;
+    struct diskcache *dc;
+
+    fill_header(&want);
+    size = sizeof(struct diskcache_header)
+           + (DISKCACHE_LAST - DISKCACHE_FIRST + 1)
+             * sizeof(struct diskcache_entry);
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) == -1)
+        return NULL;
+
+    /* only one process checks and rewrites the header at a time. The file
+     * is never shrunk, others may have it mapped. */
+    if (lockrange(fd, F_WRLCK, 0, sizeof(struct diskcache_header)) == -1
+        || fstat(fd, &st) == -1)
+        goto fail;
+
+    memset(&have, 0, sizeof(have));
+    if (pread(fd, &have, sizeof(have), 0) != sizeof(have)
+        || memcmp(&have, &want, sizeof(have)) != 0) {
+        /* another version or configuration of the cache is started over */
+        if (st.st_size > 0
+            && memcmp(have.magic, want.magic, sizeof(have.magic)) != 0) {
+            errno = EINVAL;
+            goto fail;
+        }
+        if (pwrite(fd, &want, sizeof(want), 0) != sizeof(want))
+            goto fail;
+    }
+
+    if ((size_t) st.st_size < size && ftruncate(fd, size) == -1)
+        goto fail;
+
+    lockrange(fd, F_UNLCK, 0, sizeof(struct diskcache_header));
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto fail;
+
+    if ((dc = (struct diskcache *) malloc(sizeof(struct diskcache))) == NULL) {
+        munmap(map, size);
+        goto fail;
+    }
+    dc->fd = fd;
+    dc->size = size;
+    dc->map = map;
+    dc->entries = (struct diskcache_entry *)
+                  ((char *) map + sizeof(struct diskcache_header));
+    dc->seed = want.checksum;
+    pthread_mutex_init(&dc->lock, NULL);
+    return dc;
+
+fail:
+    close(fd);
+    return NULL;
+}
+
+
+void diskcache_close(struct diskcache *dc)
+{
+    if (dc == NULL)
+        return;
+
+    munmap(dc->map, dc->size);
+    close(dc->fd);
+    pthread_mutex_destroy(&dc->lock);
+    free(dc);
+}
+
+
+/*
+ * copy year from the cache file to ly
+ *
+ * Return: 0 on success, -1 if year is not in the file
+ */
+int diskcache_get(struct diskcache *dc, int year, struct lunaryear *ly)
+{
+    unsigned int sum;
+    struct diskcache_entry *p;
+
+    if (year < DISKCACHE_FIRST || year > DISKCACHE_LAST)
+        return -1;
+
+    p = &dc->entries[year - DISKCACHE_FIRST];
+    sum = __atomic_load_n(&p->checksum, __ATOMIC_ACQUIRE);
+    if (sum == 0)
+        return -1;
+
+    memcpy(ly, &p->ly, sizeof(struct lunaryear));
+    if (p->year != year || ly->year != year
+        || sum != entry_checksum(dc, year, ly))
+        return -1;
+
+    return 0;
+}
+
+
+/* save year ly to the cache file, years out of its range are not saved */
+void diskcache_put(struct diskcache *dc, const struct lunaryear *ly)
+{
+    off_t off;
+    struct diskcache_entry *p;
+
+    if (ly->year < DISKCACHE_FIRST || ly->year > DISKCACHE_LAST)
+        return;
+
+    p = &dc->entries[ly->year - DISKCACHE_FIRST];
+    off = (char *) p - (char *) dc->map;
+
+    pthread_mutex_lock(&dc->lock);
+    if (lockrange(dc->fd, F_WRLCK, off, sizeof(struct diskcache_entry)) == 0) {
+        __atomic_store_n(&p->checksum, 0, __ATOMIC_RELEASE);
+        p->year = ly->year;
+        memcpy(&p->ly, ly, sizeof(struct lunaryear));
+        __atomic_store_n(&p->checksum, entry_checksum(dc, ly->year, ly),
+                         __ATOMIC_RELEASE);
+        lockrange(dc->fd, F_UNLCK, off, sizeof(struct diskcache_entry));
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
@@ -0,0 +1,592 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Emitters, the days of a lunar calendar written out in one format.
+
+cn_lunarcal() and cn_lunarcal_range() only work out the days and pass each
+to a chain of emitters, so one pass of the astronomy can write several
+formats at once:
+
+    ics     the VEVENTs of an iCalendar file
+    csv     one line per day, after a header line
+    jsonl   one JSON object per day
+    binary  fixed width little endian records after a header, see
+            binary_day()
+
+Once the years come from a cache formatting is most of the work. So a day
+is put together from fragments that are ready in advance, the DTSTAMP line
+of the engine and the labels of lunarday_summary(), with the dates
+converted to digits by integer math. Nothing is parsed and there is no
+printf. An emitter writes into one large buffer, written out by write()
+when it is full, or kept in memory for a worker to hand over.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "astro.h"
+#include "lunarcalbase.h"
+
+#define EMIT_BUFSIZE (1 << 16)
+#define EMIT_ALIGN 4096   /* buffers start on a page, for the files of shards */
+#define EMIT_DAYSIZE (4 * BUFSIZE + 256)  /* room for one day in any format */
+
+#define BINARY_MAGIC "LUNARDAY"
+#define BINARY_VERSION 1
+#define BINARY_RECORD 12
+
+struct emitops {
+    const char *name;
+    void (*begin)(struct emitter *em, int start, int end, int events);
+    void (*day)(struct emitter *em, struct lcengine *e,
+                const struct lunarcal *lc);
+    void (*end)(struct emitter *em);
+};
+
+static const struct emitops *const EMITOPS[EMIT_FORMATS];
+
+
+/*
+ * start writing format to fd, or to memory if fd is -1, see emit_detach()
+ *
+ * Return: 0 on success, -1 if out of memory or format is unknown
+ */
+int emit_open(struct emitter *em, int format, int fd)
+{
+    memset(em, 0, sizeof(struct emitter));
+    if (format < 0 || format >= EMIT_FORMATS)
+        return -1;
+
+    em->format = format;
+    em->fd = fd;
+    em->size = EMIT_BUFSIZE;
+    em->jdn = -1;
+    if (posix_memalign((void **) &em->buf, EMIT_ALIGN, em->size)) {
+        em->buf = NULL;
+        em->size = 0;
+        return -1;
+    }
+    return 0;
+}
+
+
+/* flush and free the buffer, the fd is not closed */
+int emit_close(struct emitter *em)
+{
+    int ret;
+
+    ret = emit_flush(em);
+    free(em->buf);
+    em->buf = NULL;
+    return ret;
+}
+
+
+/*
+ * the output written to memory so far, the caller frees it. em is empty
+ * afterwards.
+ */
+char *emit_detach(struct emitter *em, size_t *len)
+{
+    char *buf = em->buf;
+
+    *len = em->len;
+    em->buf = NULL;
+    em->len = 0;
+    em->size = 0;
+    return buf;
+}
+
+
+/*
+ * EMIT_ format called name, e.g. "csv"
+ *
+ * Return: -1 if there is no such format
+ */
+int emit_format(const char *name)
+{
+    int i;
+
+    for (i = 0; i < EMIT_FORMATS; i++)
+        if (strcmp(name, EMITOPS[i]->name) == 0)
+            return i;
+    return -1;
+}
+
+
+/* name of EMIT_ format, e.g. "csv" */
+const char *emit_name(int format)
+{
+    return EMITOPS[format]->name;
+}
+
+
+/* write all of iov to fd, retry short writes */
+static int writeall(int fd, struct iovec *iov, int n)
+{
+    ssize_t r;
+
+    while (n > 0) {
+        if ((r = writev(fd, iov, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (; n > 0 && (size_t) r >= iov->iov_len; iov++, n--)
+            r -= iov->iov_len;
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * write len bytes at buf to fd
+ *
+ * Return: 0 on success, -1 on error
+ */
+int write_all(int fd, const char *buf, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+    return writeall(fd, &iov, 1);
+}
+
+
+/*
+ * write out the buffer, nothing to do in memory
+ *
+ * Return: 0 on success, -1 if a write failed
+ */
+int emit_flush(struct emitter *em)
+{
+    struct iovec iov;
+
+    if (em->fd == -1 || em->len == 0)
+        return em->error;
+
+    iov.iov_base = em->buf;
+    iov.iov_len = em->len;
+    if (writeall(em->fd, &iov, 1) != 0)
+        em->error = -1;
+    em->len = 0;
+    return em->error;
+}
+
+
+/* make room for len more bytes */
+static int reserve(struct emitter *em, size_t len)
+{
+    size_t size;
+    char *buf;
+
+    if (em->len + len <= em->size)
+        return 0;
+
+    if (em->fd != -1) {
+        emit_flush(em);
+        if (len <= em->size)
+            return 0;
+    }
+
+    for (size = em->size ? em->size : EMIT_BUFSIZE; size < em->len + len; )
+        size *= 2;
+    if (posix_memalign((void **) &buf, EMIT_ALIGN, size)) {
+        em->error = -1;
+        return -1;
+    }
+
+    if (em->buf) {
+        memcpy(buf, em->buf, em->len);
+        free(em->buf);
+    }
+    em->buf = buf;
+    em->size = size;
+    return 0;
+}
+
+
+/* append len bytes at s, big blocks go out together with the buffer */
+void emit_write(struct emitter *em, const char *s, size_t len)
+{
+    struct iovec iov[2];
+
+    if (em->fd != -1 && len >= EMIT_BUFSIZE) {
+        iov[0].iov_base = em->buf;
+        iov[0].iov_len = em->len;
+        iov[1].iov_base = (void *) s;
+        iov[1].iov_len = len;
+        if (writeall(em->fd, iov, 2) != 0)
+            em->error = -1;
+        em->len = 0;
+        return;
+    }
+
+    if (reserve(em, len) == 0) {
+        memcpy(em->buf + em->len, s, len);
+        em->len += len;
+    }
+}
+
+
+/*
+ * start a calendar of years start to end with EV_ flags events on every
+ * emitter chained from em, e.g. the ICS header
+ */
+void emit_begin(struct emitter *em, int start, int end, int events)
+{
+    for (; em; em = em->next)
+        if (EMITOPS[em->format]->begin)
+            EMITOPS[em->format]->begin(em, start, end, events);
+}
+
+
+/* write day lc to every emitter chained from em */
+void emit_day(struct emitter *em, struct lcengine *e,
+              const struct lunarcal *lc)
+{
+    for (; em; em = em->next)
+        if (reserve(em, EMIT_DAYSIZE) == 0)
+            EMITOPS[em->format]->day(em, e, lc);
+}
+
+
+/* finish the calendar on every emitter chained from em */
+void emit_end(struct emitter *em)
+{
+    for (; em; em = em->next)
+        if (EMITOPS[em->format]->end)
+            EMITOPS[em->format]->end(em);
+}
+
+
+/* Gregorian date of Julian Day Number jdn as jd2g(), Julian before 1582 */
+static void jdn2date(int jdn, int *year, int *month, int *day)
+{
+    int a, b, c, d, e, alpha;
+
+    if (jdn < 2299161) {
+        a = jdn;
+    } else {
+        alpha = (4 * jdn - 7468865) / 146097;
+        a = jdn + 1 + alpha - alpha / 4;
+    }
+    b = a + 1524;
+    c = (100 * b - 12210) / 36525;
+    d = 1461 * c / 4;
+    e = 10000 * (b - d) / 306001;
+    *day = b - d - 306001 * e / 10000;
+    *month = (e < 14) ? e - 1 : e - 13;
+    *year = (*month > 2) ? c - 4716 : c - 4715;
+}
+
+
+/* put n as digits, zero padded to width */
+static char *putnum(char *p, int n, int width)
+{
+    char *q;
+
+    for (q = p + width - 1; q >= p; q--) {
+        *q = '0' + n % 10;
+        n /= 10;
+    }
+    return p + width;
+}
+
+
+/* put n as digits, as %d */
+static char *putint(char *p, int n)
+{
+    int width;
+    unsigned int u, t;
+
+    if (n < 0)
+        *p++ = '-';
+    u = (n < 0) ? -(unsigned int) n : (unsigned int) n;
+    for (width = 1, t = u; t >= 10; t /= 10)
+        width++;
+    return putnum(p, u, width);
+}
+
+
+/* put string s without its '\0' */
+static char *putstr(char *p, const char *s)
+{
+    size_t n = strlen(s);
+
+    memcpy(p, s, n);
+    return p + n;
+}
+
+
+/*
+ * YYYYMMDD and YYYY-MM-DD of day jdn, as jdftime() prints them. Years out of
+ * 0 - 9999 do not fit 4 digits and are left to snprintf.
+ */
+static void fmtdate(int jdn, char *ymd, char *iso)
+{
+    int y, m, d;
+    char *p;
+
+    jdn2date(jdn, &y, &m, &d);
+    if (y < 0 || y > 9999) {
+        snprintf(ymd, BUFSIZE, "%04d%02d%02d", y, m, d);
+        snprintf(iso, BUFSIZE, "%04d-%02d-%02d", y, m, d);
+        return;
+    }
+
+    p = putnum(ymd, y, 4);
+    p = putnum(p, m, 2);
+    p = putnum(p, d, 2);
+    *p = '\0';
+
+    p = putnum(iso, y, 4);
+    *p++ = '-';
+    p = putnum(p, m, 2);
+    *p++ = '-';
+    p = putnum(p, d, 2);
+    *p = '\0';
+}
+
+
+/*
+ * dates of day jdn into ymd and iso, and of the next day into em->ymd and
+ * em->iso. The day after is the next one written, so it is formatted once.
+ */
+static void daydates(struct emitter *em, int jdn, char *ymd, char *iso)
+{
+    if (jdn == em->jdn) {
+        memcpy(ymd, em->ymd, BUFSIZE);
+        memcpy(iso, em->iso, BUFSIZE);
+    } else {
+        fmtdate(jdn, ymd, iso);
+    }
+    fmtdate(jdn + 1, em->ymd, em->iso);
+    em->jdn = jdn + 1;
+}
+
+
+#define PUT(p, lit) (memcpy(p, lit, sizeof(lit) - 1), p + sizeof(lit) - 1)
+
+static void ics_begin(struct emitter *em, int start, int end, int events)
+{
+    int n;
+    char header[BUFSIZE * 8];
+
+    n = snprintf(header, sizeof(header), "BEGIN:VCALENDAR\n"
+                 "PRODID:-//Chen Wei//Chinese Lunar Calendar//EN\n"
+                 "VERSION:2.0\n"
+                 "CALSCALE:GREGORIAN\n"
+                 "METHOD:PUBLISH\n"
+                 "X-WR-CALNAME:农历\n"
+                 "X-WR-TIMEZONE:Asia/Shanghai\n"
+                 "X-WR-CALDESC:中国农历%d-%d%s.\n", start, end,
+                 (events & EV_SOLARTERMS) ? ", 包括节气" : "");
+    emit_write(em, header, n);
+}
+
+
+/* the VEVENT of day lc, with the DTSTAMP of engine e */
+static void ics_day(struct emitter *em, struct lcengine *e,
+                    const struct lunarcal *lc)
+{
+    char *p;
+    char iso[BUFSIZE], start[BUFSIZE];
+
+    /* the DTEND of a day is the DTSTART of the next one */
+    daydates(em, lc->jdn, start, iso);
+
+    p = em->buf + em->len;
+    p = PUT(p, "BEGIN:VEVENT\nDTSTAMP:");
+    p = putstr(p, e->dtstamp);
+    p = PUT(p, "\nUID:");
+    p = putstr(p, iso);
+    p = PUT(p, "-lc@infinet.github.io\nDTSTART;VALUE=DATE:");
+    p = putstr(p, start);
+    p = PUT(p, "\nDTEND;VALUE=DATE:");
+    p = putstr(p, em->ymd);
+    p = PUT(p, "\nSTATUS:CONFIRMED\nSUMMARY:");
+    p += lunarday_summary(p, lc);
+    p = PUT(p, "\nEND:VEVENT\n");
+    em->len = p - em->buf;
+}
+
+
+static void ics_end(struct emitter *em)
+{
+    emit_write(em, "END:VCALENDAR\n", 14);
+}
+
+
+static void csv_begin(struct emitter *em, int start, int end, int events)
+{
+    static const char header[] =
+        "date,lunar_year,month,day,leap,solarterm,holiday,summary\n";
+
+    emit_write(em, header, sizeof(header) - 1);
+}
+
+
+/* e.g. 2016-02-08,2016,1,1,0,,春节,丙申[猴]正月 春节 */
+static void csv_day(struct emitter *em, struct lcengine *e,
+                    const struct lunarcal *lc)
+{
+    char *p;
+    char ymd[BUFSIZE], iso[BUFSIZE];
+
+    daydates(em, lc->jdn, ymd, iso);
+
+    p = em->buf + em->len;
+    p = putstr(p, iso);
+    *p++ = ',';
+    p = putint(p, lc->lyear);
+    *p++ = ',';
+    p = putint(p, lc->month);
+    *p++ = ',';
+    p = putint(p, lc->day);
+    *p++ = ',';
+    *p++ = lc->is_lm ? '1' : '0';
+    *p++ = ',';
+    if (lc->solarterm != -1)
+        p = putstr(p, solarterm_name(lc->solarterm));
+    *p++ = ',';
+    if (lc->holiday != -1)
+        p = putstr(p, holiday_name(lc->holiday));
+    *p++ = ',';
+    p += lunarday_summary(p, lc);
+    *p++ = '\n';
+    em->len = p - em->buf;
+}
+
+
+/*
+ * e.g. {"date":"2016-02-08","lunar_year":2016,"month":1,"day":1,
+ * "leap":false,"solarterm":null,"holiday":"春节","summary":"丙申[猴]正月 春节"}
+ */
+static void jsonl_day(struct emitter *em, struct lcengine *e,
+                      const struct lunarcal *lc)
+{
+    char *p;
+    char ymd[BUFSIZE], iso[BUFSIZE];
+
+    daydates(em, lc->jdn, ymd, iso);
+
+    p = em->buf + em->len;
+    p = PUT(p, "{\"date\":\"");
+    p = putstr(p, iso);
+    p = PUT(p, "\",\"lunar_year\":");
+    p = putint(p, lc->lyear);
+    p = PUT(p, ",\"month\":");
+    p = putint(p, lc->month);
+    p = PUT(p, ",\"day\":");
+    p = putint(p, lc->day);
+    p = lc->is_lm ? PUT(p, ",\"leap\":true") : PUT(p, ",\"leap\":false");
+    if (lc->solarterm != -1) {
+        p = PUT(p, ",\"solarterm\":\"");
+        p = putstr(p, solarterm_name(lc->solarterm));
+        *p++ = '"';
+    } else {
+        p = PUT(p, ",\"solarterm\":null");
+    }
+    if (lc->holiday != -1) {
+        p = PUT(p, ",\"holiday\":\"");
+        p = putstr(p, holiday_name(lc->holiday));
+        *p++ = '"';
+    } else {
+        p = PUT(p, ",\"holiday\":null");
+    }
+    p = PUT(p, ",\"summary\":\"");
+    p += lunarday_summary(p, lc);
+    p = PUT(p, "\"}\n");
+    em->len = p - em->buf;
+}
+
+
+static char *put16le(char *p, unsigned int n)
+{
+    *p++ = n & 0xff;
+    *p++ = (n >> 8) & 0xff;
+    return p;
+}
+
+
+static char *put32le(char *p, unsigned int n)
+{
+    p = put16le(p, n & 0xffff);
+    return put16le(p, n >> 16);
+}
+
+
+/* BINARY_MAGIC, then version, record size and a reserved word */
+static void binary_begin(struct emitter *em, int start, int end, int events)
+{
+    char header[16], *p;
+
+    p = PUT(header, BINARY_MAGIC);
+    p = put16le(p, BINARY_VERSION);
+    p = put16le(p, BINARY_RECORD);
+    put32le(p, 0);
+    emit_write(em, header, sizeof(header));
+}
+
+
+/*
+ * a record of BINARY_RECORD bytes, little endian:
+ *
+ *     0  uint32  Julian Day Number
+ *     4  int16   lunar year
+ *     6  uint8   month, 1 - 12
+ *     7  uint8   day, 1 - 30
+ *     8  uint8   1 in a leap month
+ *     9  int8    solar term, index of solarterm_name(), -1 if none
+ *    10  int8    holiday, index of holiday_name(), -1 if none
+ *    11  uint8   0
+ */
+static void binary_day(struct emitter *em, struct lcengine *e,
+                       const struct lunarcal *lc)
+{
+    char *p;
+
+    p = em->buf + em->len;
+    p = put32le(p, lc->jdn);
+    p = put16le(p, (unsigned int) lc->lyear);
+    *p++ = lc->month;
+    *p++ = lc->day;
+    *p++ = lc->is_lm;
+    *p++ = lc->solarterm;
+    *p++ = lc->holiday;
+    *p++ = 0;
+    em->len = p - em->buf;
+}
+
+
+static const struct emitops ICS_OPS = {
+    "ics", ics_begin, ics_day, ics_end
+};
+
+static const struct emitops CSV_OPS = {
+    "csv", csv_begin, csv_day, NULL
+};
+
+static const struct emitops JSONL_OPS = {
+    "jsonl", NULL, jsonl_day, NULL
+};
+
+static const struct emitops BINARY_OPS = {
+    "binary", binary_begin, binary_day, NULL
+};
+
+/* by EMIT_ format */
+static const struct emitops *const EMITOPS[EMIT_FORMATS] = {
+    &ICS_OPS, &CSV_OPS, &JSONL_OPS, &BINARY_OPS
+};
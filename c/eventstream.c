@@ -0,0 +1,162 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Stream of new moons and solar terms.
+
+A lunar calendar only needs the new moons and solar terms in time order. The
+stream computes them in batches on demand, keeps a window of the recent
+ones, and hands each out as many times as asked, so consecutive years of a
+calendar never solve the same event twice.
+
+New moons are keyed by lunation number, 0 is the new moon of 2000-01-06.
+Solar terms are keyed by solar term number n, the Sun at 15 * (n mod 24)
+degrees from the Vernal Equinox of year n / 24, rounded down. So the Winter
+Solstice of a year is 24 * year + 18.
+
+A caller that needs only a few events asks for them by number with
+stream_newmoons() or stream_solarterms(). Those are solved in one batch and
+kept apart from the window, in a slot by their number, so the ones in
+between are never solved.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "astro.h"
+
+typedef void (*eventfinder)(double jds[], long first, int count, double tz);
+typedef void (*eventlister)(double jds[], const long nums[], int count,
+                            double tz);
+
+
+void eventstream_init(struct eventstream *s, double tz)
+{
+    int i;
+
+    memset(s, 0, sizeof(struct eventstream));
+    s->tz = tz;
+    for (i = 0; i < EVENT_WINDOW; i++)
+        s->nmsp_num[i] = s->stsp_num[i] = LONG_MIN;
+}
+
+
+/*
+ * make sure event key is in the window ev[] which starts at *first.
+ *
+ * Requests right after the window extend it by at least EVENT_AHEAD events,
+ * the oldest events are dropped if the window gets full. Any other request
+ * restarts the window at key.
+ */
+static double stream_get(struct eventstream *s, eventfinder find, double ev[],
+                         long *first, int *count, long key)
+{
+    long end;
+    int n, drop;
+
+    if (key >= *first && key < *first + *count)
+        return ev[key - *first];
+
+    end = *first + *count;
+    if (*count == 0 || key < *first
+        || key - end >= EVENT_WINDOW - EVENT_AHEAD) {
+        *first = key;
+        *count = 0;
+        end = key;
+    }
+
+    n = key - end + 1;
+    n = (n < EVENT_AHEAD) ? EVENT_AHEAD : n;
+    if (*count + n > EVENT_WINDOW) {
+        drop = *count + n - EVENT_WINDOW;
+        memmove(ev, ev + drop, (*count - drop) * sizeof(double));
+        *first += drop;
+        *count -= drop;
+    }
+
+    (*find)(ev + *count, end, n, s->tz);
+    *count += n;
+    s->computed += n;
+    return ev[key - *first];
+}
+
+
+/* JDTT of the new moon of lunation k, the date is exact in s->tz */
+double stream_newmoon(struct eventstream *s, long k)
+{
+    return stream_get(s, findlunations_date, s->nm, &s->nm_first,
+                      &s->nm_count, k);
+}
+
+
+/* JDTT of solar term number n, the date is exact in s->tz */
+double stream_solarterm(struct eventstream *s, long n)
+{
+    return stream_get(s, findsolarterms_bynum_date, s->st, &s->st_first,
+                      &s->st_count, n);
+}
+
+
+/*
+ * events nums[0] ... nums[count - 1] into jds, nums in increasing order.
+ * Those not in the window ev[] or kept in sp[] are found together in one
+ * batch, and kept in sp[] by their number.
+ */
+static void stream_pick(struct eventstream *s, eventlister find,
+                        const double ev[], long first, int n_ev,
+                        long sp_num[], double sp[], const long nums[],
+                        int count, double jds[])
+{
+    int i, k, n, slot[count];
+    long todo[count];
+    double found[count];
+
+    n = 0;
+    for (i = 0; i < count; i++) {
+        k = (int) (((nums[i] % EVENT_WINDOW) + EVENT_WINDOW) % EVENT_WINDOW);
+        if (nums[i] >= first && nums[i] < first + n_ev) {
+            jds[i] = ev[nums[i] - first];
+        } else if (sp_num[k] == nums[i]) {
+            jds[i] = sp[k];
+        } else {
+            slot[n] = i;
+            todo[n++] = nums[i];
+        }
+    }
+
+    if (n == 0)
+        return;
+
+    (*find)(found, todo, n, s->tz);
+    s->computed += n;
+    for (i = 0; i < n; i++) {
+        jds[slot[i]] = found[i];
+        k = (int) (((todo[i] % EVENT_WINDOW) + EVENT_WINDOW) % EVENT_WINDOW);
+        sp_num[k] = todo[i];
+        sp[k] = found[i];
+    }
+}
+
+
+/* JDTT of lunations nums[0] ... nums[count - 1], see stream_pick() */
+void stream_newmoons(struct eventstream *s, const long nums[], int count,
+                     double jds[])
+{
+    stream_pick(s, findlunations_bynums_date, s->nm, s->nm_first,
+                s->nm_count, s->nmsp_num, s->nmsp, nums, count, jds);
+}
+
+
+/* JDTT of solar terms nums[0] ... nums[count - 1], see stream_pick() */
+void stream_solarterms(struct eventstream *s, const long nums[], int count,
+                       double jds[])
+{
+    stream_pick(s, findsolarterms_bynums_date, s->st, s->st_first,
+                s->st_count, s->stsp_num, s->stsp, nums, count, jds);
+}
+
+
+/* solar term number of the Winter Solstice of year */
+long stream_winter_solstice(int year)
+{
+    return 24L * year + 18;
+}
@@ -0,0 +1,162 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Date conversion from the packed lunar table.
+
+Inside the years of a struct lunartable a date is converted with a few shifts
+and adds, no astronomy at all. Outside of them the conversion falls back to
+the engine, whose answers the table was generated from, so both paths agree
+day by day. See gentable.c.
+*/
+
+#include <stdio.h>
+#include "astro.h"
+#include "lunarcalbase.h"
+
+#define TABLE_LEAP(w)     (((w) >> 13) & 0xf)
+#define TABLE_NEWYEAR(w)  (((w) >> 17) & 0x3f)
+
+/* days before each month in a common year */
+static const short MONTH_DAYS[] = {
+    0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+};
+
+
+static int isleap(int year)
+{
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+
+/* Julian Day Number of January 1 of year in the Gregorian calendar */
+static int jan1(int year)
+{
+    year -= 1;
+    return 1721426 + 365 * year + year / 4 - year / 100 + year / 400;
+}
+
+
+/* JDN of 正月初一 of lunar year y of table t */
+static int newyear(const struct lunartable *t, int y)
+{
+    return jan1(y) + TABLE_NEWYEAR(t->years[y - t->first]);
+}
+
+
+/* JDN of solar term j, 0 is 小寒, of Gregorian year of table t */
+static int termday(const struct lunartable *t, int year, int j)
+{
+    int d;
+
+    d = t->termbase[j] + ((t->terms[year - t->first] >> (2 * j)) & 3);
+    if (j >= 4 && isleap(year))
+        d += 1;   /* 驚蟄 and later are after February 29 */
+    return jan1(year) + d;
+}
+
+
+/*
+ * convert Gregorian date to lunar calendar date by table t, or by engine e
+ * if the date is not in t. e may be NULL to use the table only.
+ *
+ * Return: 0 on success, -1 on error or if the date is not in t and e is NULL
+ */
+int fast_solar2lunar(const struct lunartable *t, struct lcengine *e,
+                     int year, int month, int day, struct lunarcal *lc)
+{
+    int i, j, y, jdn, doy, start, len, leap, nmonths, model;
+    unsigned int w;
+
+    if (month < 1 || month > 12 || day < 1 || day > 31)
+        return -1;
+
+    doy = MONTH_DAYS[month - 1] + day - 1;
+    if (month > 2 && isleap(year))
+        doy += 1;
+    jdn = jan1(year) + doy;
+
+    y = year;
+    if (y >= t->first && y <= t->last && jdn < newyear(t, y))
+        y--;
+    if (y < t->first || year > t->last)
+        return e ? solar2lunar(e, year, month, day, lc) : -1;
+
+    /* find the month */
+    w = t->years[y - t->first];
+    leap = TABLE_LEAP(w);
+    nmonths = leap ? 13 : 12;
+    start = newyear(t, y);
+    for (i = 0; i < nmonths - 1; i++) {
+        len = 29 + ((w >> i) & 1);
+        if (jdn < start + len)
+            break;
+        start += len;
+    }
+
+    lcinit(lc, jdn - 0.5);
+    lc->lyear = y;
+    lc->day = jdn - start + 1;
+    if (leap && i == leap) {
+        lc->month = leap;
+        lc->is_lm = 1;
+    } else {
+        lc->month = (leap && i > leap) ? i : i + 1;
+    }
+
+    /* solar terms are about 15.2 days apart, check the nearest two */
+    j = (doy - 5) * 10 / 152;
+    j = (j < 0) ? 0 : (j > 22) ? 22 : j;
+    if (termday(t, year, j + 1) <= jdn)
+        j++;
+    if (termday(t, year, j) == jdn) {
+        /* numbered as in the lunar year the calendar takes the day from,
+         * which starts at month 11 */
+        model = (month >= 11 && lc->month >= 11) ? year + 1 : year;
+        lc->solarterm = 24 * (year - model) + 3 + j;
+    }
+
+    lc->holiday = find_holiday(lc, termday(t, year, 6), newyear(t, year));
+    return 0;
+}
+
+
+/*
+ * convert lunar calendar date to Gregorian date by table t, or by engine e
+ * if lyear is not in t. e may be NULL to use the table only.
+ *
+ * Return: 0 on success, -1 if lyear has no such month or the month has no
+ *         such day, or lyear is not in t and e is NULL
+ */
+int fast_lunar2solar(const struct lunartable *t, struct lcengine *e,
+                     int lyear, int month, int day, int is_lm,
+                     GregorianDate *g)
+{
+    int i, n, jdn, leap;
+    unsigned int w;
+
+    if (month < 1 || month > 12 || day < 1 || day > 30)
+        return -1;
+
+    if (lyear < t->first || lyear > t->last)
+        return e ? lunar2solar(e, lyear, month, day, is_lm, g) : -1;
+
+    w = t->years[lyear - t->first];
+    leap = TABLE_LEAP(w);
+    if (is_lm && month != leap)
+        return -1;
+
+    /* index of the month, the leap month comes after its namesake */
+    n = month - 1;
+    if (leap && (month > leap || is_lm))
+        n++;
+
+    if (day > 29 + (int) ((w >> n) & 1))
+        return -1;
+
+    jdn = newyear(t, lyear);
+    for (i = 0; i < n; i++)
+        jdn += 29 + ((w >> i) & 1);
+
+    *g = jd2g(jdn + day - 1.5);
+    return 0;
+}
@@ -0,0 +1,430 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Generate the packed lunar table, lunartable.c, from the engine.
+
+Every day of the table range is taken from the engine, packed, then read
+back through fastcal.c and compared with the engine again, so the table can
+not disagree with the calendar lunarcal prints. With -c the table is also
+cross-checked against an ics file such as the Hong Kong Observatory based
+chinese_lunar_2000-01-01_2060-12-31.ics, and gentable fails if a day other
+than the known differences in KNOWN_DIFFS differs.
+
+Usage: gentable [-c icsfile] firstyear lastyear > lunartable.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "astro.h"
+#include "lunarcalbase.h"
+
+#define MAX_LINE 256
+#define MAX_TOKENS 4
+
+/*
+ * days known to differ from the Hong Kong Observatory, as YYYYMMDD, see the
+ * README. A solar term or new moon seconds from midnight falls on the other
+ * day.
+ */
+static const struct {
+    int first;
+    int last;
+} KNOWN_DIFFS[] = {
+    {19790120, 19790120},    /* 大寒 */
+    {20570928, 20571027},    /* the new moon of 九月 */
+};
+
+void usage(void);
+void fail(const char *msg, int year);
+void *xmalloc(size_t size);
+int jdn_jan1(int year);
+void pack_years(struct lcengine *e, unsigned int *years, int first, int last);
+void pack_terms(struct lcengine *e, unsigned long long *terms, short *termbase,
+                int first, int last);
+int same_day(const struct lunarcal *a, const struct lunarcal *b);
+void verify(struct lcengine *e, const struct lunartable *t);
+int split(char *s, char *tokens[]);
+int same_summary(char *a, char *b);
+int known_diff(int y, int m, int d);
+int crosscheck(const struct lunartable *t, const char *path);
+void print_table(const struct lunartable *t);
+
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: gentable [-c icsfile] firstyear lastyear\n");
+    exit(2);
+}
+
+
+void fail(const char *msg, int year)
+{
+    fprintf(stderr, "gentable: %s, year %d\n", msg, year);
+    exit(1);
+}
+
+
+void *xmalloc(size_t size)
+{
+    void *p;
+
+    if ((p = malloc(size)) == NULL) {
+        fprintf(stderr, "gentable: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+
+int jdn_jan1(int year)
+{
+    return (int) (g2jd(year, 1, 1.0) + 0.5);
+}
+
+
+/* month lengths, leap month and 正月初一 of lunar years first to last */
+void pack_years(struct lcengine *e, unsigned int *years, int first, int last)
+{
+    int y, i, jdn, start, end, leap, offset;
+    unsigned int w;
+    GregorianDate g;
+    struct lunarcal lc;
+
+    for (y = first; y <= last; y++) {
+        if (lunar2solar(e, y, 1, 1, 0, &g) != 0)
+            fail("no 正月初一", y);
+        start = (int) (g2jd(g.year, g.month, g.day) + 0.5);
+        if (lunar2solar(e, y + 1, 1, 1, 0, &g) != 0)
+            fail("no 正月初一", y + 1);
+        end = (int) (g2jd(g.year, g.month, g.day) + 0.5);
+
+        offset = start - jdn_jan1(y);
+        if (offset < 0 || offset > 0x3f)
+            fail("正月初一 out of range", y);
+
+        w = 0;
+        leap = 0;
+        i = -1;
+        for (jdn = start; jdn < end; jdn++) {
+            g = jd2g(jdn - 0.5);
+            solar2lunar(e, g.year, g.month, (int) g.day, &lc);
+            if (lc.lyear != y)
+                fail("unexpected lunar year", y);
+
+            if (lc.day == 1) {
+                i++;
+                if (lc.is_lm)
+                    leap = lc.month;
+            }
+            if (lc.day == 30)
+                w |= 1u << i;
+        }
+
+        if (i != (leap ? 12 : 11))
+            fail("unexpected months", y);
+
+        years[y - first] = w | leap << 13 | offset << 17;
+    }
+}
+
+
+/*
+ * dates of the 24 solar terms of Gregorian years first to last, in days
+ * after the earliest date of each term
+ */
+void pack_terms(struct lcengine *e, unsigned long long *terms, short *termbase,
+                int first, int last)
+{
+    int y, j, jdn, d, nterms, leap;
+    int *days;
+    GregorianDate g;
+    struct lunarcal lc;
+
+    days = (int *) xmalloc((last - first + 1) * 24 * sizeof(int));
+    for (j = 0; j < 24; j++)
+        termbase[j] = 366;
+
+    for (y = first; y <= last; y++) {
+        leap = jdn_jan1(y + 1) - jdn_jan1(y) == 366;
+        nterms = 0;
+        for (jdn = jdn_jan1(y); jdn < jdn_jan1(y + 1); jdn++) {
+            g = jd2g(jdn - 0.5);
+            solar2lunar(e, g.year, g.month, (int) g.day, &lc);
+            if (lc.solarterm == -1)
+                continue;
+
+            /* 小寒 is index 3, the 小雪 to 冬至 ending a year are numbered
+             * from the next lunar year at times */
+            j = (lc.solarterm >= 3) ? lc.solarterm - 3 : lc.solarterm + 21;
+            if (j != nterms++)
+                fail("solar terms out of order", y);
+
+            d = jdn - jdn_jan1(y);
+            if (j >= 4 && leap)
+                d -= 1;
+            days[(y - first) * 24 + j] = d;
+            if (d < termbase[j])
+                termbase[j] = d;
+        }
+
+        if (nterms != 24)
+            fail("missing solar terms", y);
+    }
+
+    for (y = first; y <= last; y++) {
+        terms[y - first] = 0;
+        for (j = 0; j < 24; j++) {
+            d = days[(y - first) * 24 + j] - termbase[j];
+            if (d > 3)
+                fail("solar term spread over 4 days", y);
+            terms[y - first] |= (unsigned long long) d << (2 * j);
+        }
+    }
+
+    free(days);
+}
+
+
+int same_day(const struct lunarcal *a, const struct lunarcal *b)
+{
+    return a->jdn == b->jdn && a->solarterm == b->solarterm
+           && a->is_lm == b->is_lm && a->lyear == b->lyear
+           && a->month == b->month && a->day == b->day
+           && a->holiday == b->holiday;
+}
+
+
+/* read every day back from the table and compare it with the engine */
+void verify(struct lcengine *e, const struct lunartable *t)
+{
+    int y, m, d, jdn, is_lm, r1, r2;
+    GregorianDate g, g1, g2;
+    struct lunarcal lc1, lc2;
+
+    for (jdn = jdn_jan1(t->first); jdn < jdn_jan1(t->last + 1); jdn++) {
+        g = jd2g(jdn - 0.5);
+        r1 = fast_solar2lunar(t, NULL, g.year, g.month, (int) g.day, &lc1);
+        solar2lunar(e, g.year, g.month, (int) g.day, &lc2);
+
+        /* days before 正月初一 of the first year are not in the table */
+        if (r1 != 0 && lc2.lyear < t->first)
+            continue;
+
+        if (r1 != 0 || !same_day(&lc1, &lc2)) {
+            fprintf(stderr, "%d-%02d-%02d: ", g.year, g.month, (int) g.day);
+            fail("table differs from engine", g.year);
+        }
+    }
+
+    for (y = t->first; y <= t->last; y++)
+        for (m = 1; m <= 12; m++)
+            for (d = 1; d <= 30; d++)
+                for (is_lm = 0; is_lm < 2; is_lm++) {
+                    r1 = fast_lunar2solar(t, NULL, y, m, d, is_lm, &g1);
+                    r2 = lunar2solar(e, y, m, d, is_lm, &g2);
+                    if (r1 != r2 || (r1 == 0 && (g1.year != g2.year
+                                                 || g1.month != g2.month
+                                                 || g1.day != g2.day)))
+                        fail("lunar date differs from engine", y);
+                }
+}
+
+
+/* split s at spaces in place */
+int split(char *s, char *tokens[])
+{
+    int n;
+    char *p;
+
+    for (n = 0; n < MAX_TOKENS && (p = strsep(&s, " ")) != NULL; )
+        if (*p)
+            tokens[n++] = p;
+
+    return n;
+}
+
+
+/* same day and month, solar terms and holidays in whatever order */
+int same_summary(char *a, char *b)
+{
+    int i, j, na, nb;
+    char *ta[MAX_TOKENS], *tb[MAX_TOKENS];
+
+    na = split(a, ta);
+    nb = split(b, tb);
+    if (na != nb || na == 0 || strcmp(ta[0], tb[0]) != 0)
+        return 0;
+
+    for (i = 1; i < na; i++) {
+        for (j = 1; j < nb; j++)
+            if (strcmp(ta[i], tb[j]) == 0)
+                break;
+        if (j == nb)
+            return 0;
+    }
+
+    return 1;
+}
+
+
+/* is y-m-d in KNOWN_DIFFS */
+int known_diff(int y, int m, int d)
+{
+    int i, date;
+
+    date = y * 10000 + m * 100 + d;
+    for (i = 0; i < (int) (sizeof(KNOWN_DIFFS) / sizeof(KNOWN_DIFFS[0])); i++)
+        if (date >= KNOWN_DIFFS[i].first && date <= KNOWN_DIFFS[i].last)
+            return 1;
+    return 0;
+}
+
+
+/*
+ * compare the SUMMARY of every day in ics file path covered by the table
+ *
+ * Return: the days that differ and are not known to
+ */
+int crosscheck(const struct lunartable *t, const char *path)
+{
+    int y, m, d, checked, differ, known;
+    char line[MAX_LINE], summary[BUFSIZE];
+    char *p;
+    FILE *fp;
+    struct lunarcal lc;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    y = m = d = 0;
+    checked = differ = known = 0;
+    while (fgets(line, MAX_LINE, fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "DTSTART;VALUE=DATE:", 19) == 0) {
+            sscanf(line + 19, "%4d%2d%2d", &y, &m, &d);
+            continue;
+        }
+
+        if (strncmp(line, "SUMMARY:", 8) != 0
+            || fast_solar2lunar(t, NULL, y, m, d, &lc) != 0)
+            continue;
+
+        p = line + 8;
+        lunarday_summary(summary, &lc);
+        checked++;
+        if (same_summary(summary, p))
+            continue;
+
+        if (known_diff(y, m, d)) {
+            known++;
+        } else {
+            differ++;
+            fprintf(stderr, "%d-%02d-%02d differs\n", y, m, d);
+        }
+    }
+    fclose(fp);
+
+    fprintf(stderr, "%s: %d days checked, %d differ, %d more as known\n",
+            path, checked, differ, known);
+    return differ;
+}
+
+
+void print_table(const struct lunartable *t)
+{
+    int i, n;
+
+    n = t->last - t->first + 1;
+    printf("/*\n"
+           " * lunar calendar %d - %d packed by gentable, do not edit.\n"
+           " * See struct lunartable in lunarcalbase.h for the layout.\n"
+           " */\n\n"
+           "#include <stdio.h>\n"
+           "#include \"astro.h\"\n"
+           "#include \"lunarcalbase.h\"\n\n", t->first, t->last);
+
+    printf("static const unsigned int YEARS[] = {");
+    for (i = 0; i < n; i++)
+        printf("%s0x%06x,", (i % 6) ? " " : "\n    ", t->years[i]);
+    printf("\n};\n\n");
+
+    printf("static const unsigned long long TERMS[] = {");
+    for (i = 0; i < n; i++)
+        printf("%s0x%012llxULL,", (i % 3) ? " " : "\n    ", t->terms[i]);
+    printf("\n};\n\n");
+
+    printf("static const short TERMBASE[] = {");
+    for (i = 0; i < 24; i++)
+        printf("%s%d,", (i % 12) ? " " : "\n    ", t->termbase[i]);
+    printf("\n};\n\n");
+
+    printf("const struct lunartable LUNARTABLE = {\n"
+           "    %d, %d, YEARS, TERMS, TERMBASE\n"
+           "};\n", t->first, t->last);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt, first, last, n;
+    char *icsfile = NULL;
+    unsigned int *years;
+    unsigned long long *terms;
+    short termbase[24];
+    struct lcengine *e;
+    struct lunartable t;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+        case 'c':
+            icsfile = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 2)
+        usage();
+
+    first = atoi(argv[optind]);
+    last = atoi(argv[optind + 1]);
+
+    /* the table does its date arithmetic in the Gregorian calendar */
+    if (first < 1583 || last < first) {
+        fprintf(stderr, "gentable: years must be after 1582\n");
+        exit(2);
+    }
+
+    n = last - first + 1;
+    years = (unsigned int *) xmalloc(n * sizeof(unsigned int));
+    terms = (unsigned long long *) xmalloc(n * sizeof(unsigned long long));
+    if ((e = lcengine_alloc()) == NULL) {
+        fprintf(stderr, "gentable: out of memory\n");
+        exit(1);
+    }
+
+    pack_years(e, years, first, last);
+    pack_terms(e, terms, termbase, first, last);
+
+    t.first = first;
+    t.last = last;
+    t.years = years;
+    t.terms = terms;
+    t.termbase = termbase;
+    verify(e, &t);
+
+    if (icsfile && crosscheck(&t, icsfile) != 0)
+        exit(1);
+
+    print_table(&t);
+
+    lcengine_free(e);
+    free(years);
+    free(terms);
+    return 0;
+}
@@ -19,9 +19,34 @@ Reference:
 #include "astro.h"
 #include "lea406-full.h"
 
-static double vlea406[MAX_THREADS];
+/*
+ * Worker pool for the full LEA-406 series.
+ *
+ * The pool is started once on the first call. The calling thread works as
+ * worker 0, the other workers sleep on a barrier between evaluations. An
+ * evaluation is a batch of up to EPOCH_BATCH epochs. Each worker sums its
+ * share of terms for every epoch into its own cache line aligned slot, the
+ * caller adds up the slots after the second barrier.
+ *
+ * Only one caller can drive the pool at a time. lea406() is re-entrant, a
+ * caller that finds the pool busy evaluates the series in its own thread,
+ * which is also the best use of the cores when several calendar engines are
+ * running in parallel.
+ */
+struct lea406_slot {
+    double v[EPOCH_BATCH];
+    double r[EPOCH_BATCH];    /* time derivatives, if asked for */
+} __attribute__ ((aligned (CACHELINE)));
+
+static struct lea406_slot vlea406[MAX_THREADS];
 static int num_threads = 0;  /* number of threads for compute lea406-full */
-static int nelems_per_thread;   /* number of elements assigned to a thread */
+static const double *pool_tc;  /* t in century of the current batch */
+static size_t pool_n;          /* number of epochs in the current batch */
+static int pool_rate;          /* sum time derivatives as well? */
+static pthread_barrier_t pool_start;  /* workers wait here for a new t */
+static pthread_barrier_t pool_done;   /* caller waits here for the results */
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* count logical CPU by parsing /proc/cpuinfo */
 int cpucount(void)
@@ -32,42 +57,127 @@ int cpucount(void)
     char buf[MAX_CPUINFO_LEN];
     fp = fopen("/proc/cpuinfo", "rb");
     logic_cpu = 0;
+    if (fp == NULL)
+        return 1;
+
     while ((s = fgets(buf, MAX_CPUINFO_LEN, fp)) != NULL) {
         if (s == strstr(buf, "processor"))
             logic_cpu += 1;
     }
+    fclose(fp);
     logic_cpu = (logic_cpu > MAX_THREADS) ? MAX_THREADS : logic_cpu;
+    logic_cpu = (logic_cpu < 1) ? 1 : logic_cpu;
     return logic_cpu;
 }
 
 
-/* the thread worker for lea406 */
+/*
+ * LEA-406 table rearranged for the term kernels, and the kernel in use.
+ *
+ * Terms are summed by the fastest kernel the CPU supports, see lea406simd.c.
+ * The kernels loop terms outermost, so each row of the table is loaded once
+ * for all epochs of a batch.
+ */
+static struct lea406_soa soa;
+static lea406kernel kernel;
+static const char *kernel_name;
+
+
+/* build the structure of arrays copy of M_ARG and the phasor form of M_AP */
+static void lea406soa_init(void)
+{
+    int i;
+    double *p;
+
+    p = (double *) malloc(9 * LEA406TERMS * sizeof(double));
+    assert(p != NULL);
+    soa.arg0 = p;
+    soa.arg1 = p + LEA406TERMS;
+    soa.arg2 = p + 2 * LEA406TERMS;
+    soa.s0   = p + 3 * LEA406TERMS;
+    soa.s1   = p + 4 * LEA406TERMS;
+    soa.s2   = p + 5 * LEA406TERMS;
+    soa.c0   = p + 6 * LEA406TERMS;
+    soa.c1   = p + 7 * LEA406TERMS;
+    soa.c2   = p + 8 * LEA406TERMS;
+    for (i = 0; i < LEA406TERMS; i++) {
+        p[i]                   = M_ARG[i][0];
+        p[i + LEA406TERMS]     = M_ARG[i][1];
+        p[i + 2 * LEA406TERMS] = M_ARG[i][2];
+        p[i + 3 * LEA406TERMS] = M_AP[i][0] * cos(M_AP[i][3] * DEG2RAD);
+        p[i + 4 * LEA406TERMS] = M_AP[i][1] * cos(M_AP[i][4] * DEG2RAD);
+        p[i + 5 * LEA406TERMS] = M_AP[i][2] * cos(M_AP[i][5] * DEG2RAD);
+        p[i + 6 * LEA406TERMS] = M_AP[i][0] * sin(M_AP[i][3] * DEG2RAD);
+        p[i + 7 * LEA406TERMS] = M_AP[i][1] * sin(M_AP[i][4] * DEG2RAD);
+        p[i + 8 * LEA406TERMS] = M_AP[i][2] * sin(M_AP[i][5] * DEG2RAD);
+    }
+
+    kernel = lea406kernel_find("best", &kernel_name);
+}
+
+
+/* sum LEA-406 terms from start up to end for n epochs, in arcsec, and the
+ * derivatives in arcsec per century if rate is not NULL */
+static void lea406terms(int start, int end, const double *t, size_t n,
+                        double *out, double *rate)
+{
+    (*kernel)(&soa, start, end, t, n, out, rate);
+}
+
+
+/* the share of terms assigned to worker tid, the last worker takes the
+ * remainder */
+static void lea406range(int tid, int *start, int *end)
+{
+    *start = (int) ((long) LEA406TERMS * tid / num_threads);
+    *end   = (int) ((long) LEA406TERMS * (tid + 1) / num_threads);
+}
+
+
+/* the thread worker for lea406, lives as long as the process */
 void *lea406worker(void *args)
 {
-    int tid, i, start, end;
-    double t, tm, tm2, V, arg;
+    int tid, start, end;
     tid = ((struct worker_param *) args)->tid;
-    t =   ((struct worker_param *) args)->tc;
-    tm = t / 10.0;
-    tm2 = tm * tm;
-
-    start = tid * nelems_per_thread;
-    end = start + nelems_per_thread;
-    end = (end > LEA406TERMS) ? LEA406TERMS : end;
-
-    V = 0.0;
-    for (i = start; i < end; i++) {
-        arg = (M_ARG[i][0] + t * (M_ARG[i][1] + M_ARG[i][2] * t)) * ASEC2RAD;
-        V +=    M_AP[i][0] * sin(arg + M_AP[i][3] * DEG2RAD)
-              + M_AP[i][1] * sin(arg + M_AP[i][4] * DEG2RAD) * tm
-              + M_AP[i][2] * sin(arg + M_AP[i][5] * DEG2RAD) * tm2;
+    lea406range(tid, &start, &end);
+
+    for (;;) {
+        pthread_barrier_wait(&pool_start);
+        lea406terms(start, end, pool_tc, pool_n, vlea406[tid].v,
+                    pool_rate ? vlea406[tid].r : NULL);
+        pthread_barrier_wait(&pool_done);
     }
 
-    vlea406[tid] = V;
     return NULL;
 }
 
 
+/* start the worker pool, called once through pthread_once */
+static void lea406pool_init(void)
+{
+    int rc, i;
+    pthread_t thread;
+    static struct worker_param thread_args[MAX_THREADS];
+
+    lea406soa_init();
+    num_threads = cpucount();
+    if (num_threads < 2)
+        return;
+
+    rc = pthread_barrier_init(&pool_start, NULL, num_threads);
+    assert(0 == rc);
+    rc = pthread_barrier_init(&pool_done, NULL, num_threads);
+    assert(0 == rc);
+
+    for (i = 1; i < num_threads; i++) {
+        thread_args[i].tid = i;
+        rc = pthread_create(&thread, NULL, lea406worker, &thread_args[i]);
+        assert(0 == rc);
+        pthread_detach(thread);
+    }
+}
+
+
 /*
  * LEA-406 Moon Solution
  *
@@ -77,42 +187,109 @@ void *lea406worker(void *args)
  *
  */
 
-/* compute moon ecliptic longitude using lea406 */
-double lea406(double jd, int ignorenutation) {
-    int rc, i;
-    double t, V;
-    t = (jd - J2000) / 36525.0;
-
-    /* set number of threads number of logical CPU */
-    num_threads = (num_threads) ? num_threads : cpucount();
-    pthread_t threads[num_threads];
-    struct worker_param *tmp;
-    struct worker_param *thread_args[num_threads];
-    /* init thread args */
-    for (i = 0; i < num_threads; i++) {
-        tmp = (struct worker_param *) malloc(sizeof(struct worker_param));
-        tmp->tc = (jd - J2000) / 36525.0;
-        tmp->tid = i;
-        thread_args[i] = tmp;
-    }
+/*
+ * compute moon ecliptic longitude for n epochs using lea406, nutation is
+ * not included
+ */
+void lea406_batch(const double *jd, size_t n, double *out)
+{
+    lea406_rate_batch(jd, n, out, NULL);
+}
 
-    nelems_per_thread = LEA406TERMS / num_threads;
-    for (i = 0; i < num_threads; i++) {
-        rc = pthread_create(&threads[i], NULL, lea406worker, thread_args[i]);
-        assert(0 == rc);
-    }
 
-    V = FRM[0] + (((FRM[4] * t + FRM[3]) * t + FRM[2]) * t + FRM[1]) * t;
-    for (i = 0; i < num_threads; i++) {
-        rc = pthread_join(threads[i], NULL);
-        assert(0 == rc);
-    }
+/*
+ * lea406_batch that also gives the rate of the longitude in radians per day
+ * if rate is not NULL. Both come from the same sincos of each term.
+ */
+void lea406_rate_batch(const double *jd, size_t n, double *out, double *rate)
+{
+    int i, start, end;
+    size_t k, m;
+    double t[EPOCH_BATCH], V[EPOCH_BATCH], R[EPOCH_BATCH];
 
-    for (i = 0; i < num_threads; i++) {
-        V += vlea406[i];
+    pthread_once(&pool_once, lea406pool_init);
+
+    while (n > 0) {
+        m = (n > EPOCH_BATCH) ? EPOCH_BATCH : n;
+        for (k = 0; k < m; k++) {
+            t[k] = (jd[k] - J2000) / 36525.0;
+            out[k] = FRM[0] + (((FRM[4] * t[k] + FRM[3]) * t[k]
+                                + FRM[2]) * t[k] + FRM[1]) * t[k];
+            if (rate)
+                rate[k] = ((4.0 * FRM[4] * t[k] + 3.0 * FRM[3]) * t[k]
+                           + 2.0 * FRM[2]) * t[k] + FRM[1];
+        }
+
+        if (num_threads < 2 || pthread_mutex_trylock(&pool_lock) != 0) {
+            lea406terms(0, LEA406TERMS, t, m, V, (rate) ? R : NULL);
+            for (k = 0; k < m; k++)
+                out[k] += V[k];
+            if (rate)
+                for (k = 0; k < m; k++)
+                    rate[k] += R[k];
+        } else {
+            pool_tc = t;
+            pool_n = m;
+            pool_rate = (rate != NULL);
+            pthread_barrier_wait(&pool_start);
+            lea406range(0, &start, &end);
+            lea406terms(start, end, t, m, vlea406[0].v,
+                        (rate) ? vlea406[0].r : NULL);
+            pthread_barrier_wait(&pool_done);
+
+            for (i = 0; i < num_threads; i++)
+                for (k = 0; k < m; k++)
+                    out[k] += vlea406[i].v[k];
+            if (rate)
+                for (i = 0; i < num_threads; i++)
+                    for (k = 0; k < m; k++)
+                        rate[k] += vlea406[i].r[k];
+            pthread_mutex_unlock(&pool_lock);
+        }
+
+        for (k = 0; k < m; k++)
+            out[k] *= ASEC2RAD;
+        if (rate) {
+            for (k = 0; k < m; k++)
+                rate[k] *= ASEC2RAD / 36525.0;
+            rate += m;
+        }
+
+        jd += m;
+        out += m;
+        n -= m;
     }
+}
 
-    V *= ASEC2RAD;
+
+/*
+ * select the term kernel by name: "scalar", "sse2", "avx2", "avx512" or
+ * "best". Not thread safe, call it before computing anything in parallel.
+ *
+ * Return:
+ *     the name of the kernel in use, NULL if the kernel is not supported and
+ *     the current kernel is kept
+ */
+const char *lea406_use_kernel(const char *name)
+{
+    const char *found;
+    lea406kernel k;
+
+    pthread_once(&pool_once, lea406pool_init);
+    if ((k = lea406kernel_find(name, &found)) == NULL)
+        return NULL;
+
+    kernel = k;
+    kernel_name = found;
+    return kernel_name;
+}
+
+
+/* compute moon ecliptic longitude using lea406 */
+double lea406(double jd, int ignorenutation) {
+    double V;
+
+    lea406_batch(&jd, 1, &V);
 
     if (!ignorenutation) {
         V += nutation(jd);
@@ -129,3 +306,28 @@ double apparentmoon(double jd, int ignorenutation)
 {
     return lea406(jd, ignorenutation);
 }
+
+
+/* apparent position of the Moon for n epochs */
+void apparentmoon_batch(const double *jd, size_t n, double *out,
+                        int ignorenutation)
+{
+    apparentmoon_rate_batch(jd, n, out, NULL, ignorenutation);
+}
+
+
+/*
+ * apparent position of the Moon and its rate in radians per day for n
+ * epochs. The rate of nutation is less than 1e-6 of the Moon's and is left
+ * out.
+ */
+void apparentmoon_rate_batch(const double *jd, size_t n, double *out,
+                             double *rate, int ignorenutation)
+{
+    size_t k;
+
+    lea406_rate_batch(jd, n, out, rate);
+    if (!ignorenutation)
+        for (k = 0; k < n; k++)
+            out[k] += nutation(jd[k]);
+}
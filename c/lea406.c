@@ -5,6 +5,10 @@ Implement astronomical algorithms for finding solar terms and moon phases.
 
 Truncated LEA-406 for calculate Moon's apparent longitude;
 
+This is the low fidelity model of the Moon, 226 of the 10,508 terms of
+lea406-full.c. The event solver converges on it first and uses the full model
+only to polish the roots.
+
 Reference:
     LEA-406: S. M. Kudryavtsev (2007) "Long-term harmonic development of
              lunar ephemeris", Astronomy and Astrophysics 471, 1069-1075
@@ -12,6 +16,7 @@ Reference:
 
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
 #include "astro.h"
 
 static double FRM[5] = {
@@ -730,6 +735,28 @@ static double M_PHASE[226][3] = {
     { -167.705956663408, -121.678544311070,  135.639537931150 },
 };
 
+/*
+ * phasor form of M_AMP and M_PHASE, built once on first use.
+ *
+ * A0 sin(arg + p0) + A1 tm sin(arg + p1) + A2 tm^2 sin(arg + p2) is
+ * S sin(arg) + C cos(arg), where S = sum Ak cos(pk) tm^k and
+ * C = sum Ak sin(pk) tm^k, so a term needs only one sincos.
+ */
+static double M_SIN[226][3];  /* Ak cos(pk), coefficient of sin(arg) */
+static double M_COS[226][3];  /* Ak sin(pk), coefficient of cos(arg) */
+static pthread_once_t phasor_once = PTHREAD_ONCE_INIT;
+
+static void phasor_init(void)
+{
+    int i, k;
+    for (i = 0; i < 226; i++) {
+        for (k = 0; k < 3; k++) {
+            M_SIN[i][k] = M_AMP[i][k] * cos(M_PHASE[i][k] * DEG2RAD);
+            M_COS[i][k] = M_AMP[i][k] * sin(M_PHASE[i][k] * DEG2RAD);
+        }
+    }
+}
+
 /*
  * LEA-406 Moon Solution
  *
@@ -739,37 +766,75 @@ static double M_PHASE[226][3] = {
  *
  */
 
-/* compute moon ecliptic longitude using lea406 */
-double lea406(double jd, int ignorenutation) {
-    double t, tm, tm2;
-    t = (jd - J2000) / 36525.0;
-    tm = t / 10.0;
-    tm2 = tm * tm;
+/*
+ * compute moon ecliptic longitude and its rate in radians per day for n
+ * epochs using the truncated lea406, nutation is not included. The rate is
+ * skipped if it is NULL.
+ */
+void lea406_low_rate_batch(const double *jd, size_t n, double *out,
+                           double *rate)
+{
+    int i;
+    size_t k, m;
+    double t[EPOCH_BATCH], tm[EPOCH_BATCH], tm2[EPOCH_BATCH];
+    double arg, sn, cs, S, C;
 
-    double V, arg;
-    V = FRM[0] + (((FRM[4] * t + FRM[3]) * t + FRM[2]) * t + FRM[1]) * t;
+    pthread_once(&phasor_once, phasor_init);
 
-    int i;
-    for (i = 0; i < 226; i++) {
-        arg = (M_ARG[i][0] + t * (M_ARG[i][1] + M_ARG[i][2] * t)) * ASEC2RAD;
-        V +=    M_AMP[i][0] * sin(arg + M_PHASE[i][0] * DEG2RAD)
-              + M_AMP[i][1] * sin(arg + M_PHASE[i][1] * DEG2RAD) * tm
-              + M_AMP[i][2] * sin(arg + M_PHASE[i][2] * DEG2RAD) * tm2;
-    }
+    while (n > 0) {
+        m = (n > EPOCH_BATCH) ? EPOCH_BATCH : n;
+        for (k = 0; k < m; k++) {
+            t[k] = (jd[k] - J2000) / 36525.0;
+            tm[k] = t[k] / 10.0;
+            tm2[k] = tm[k] * tm[k];
+            out[k] = FRM[0] + (((FRM[4] * t[k] + FRM[3]) * t[k]
+                                + FRM[2]) * t[k] + FRM[1]) * t[k];
+            if (rate)
+                rate[k] = ((4.0 * FRM[4] * t[k] + 3.0 * FRM[3]) * t[k]
+                           + 2.0 * FRM[2]) * t[k] + FRM[1];
+        }
+
+        for (i = 0; i < 226; i++) {
+            for (k = 0; k < m; k++) {
+                arg = (M_ARG[i][0] + t[k] * (M_ARG[i][1] + M_ARG[i][2] * t[k]))
+                      * ASEC2RAD;
+                sn = sin(arg);
+                cs = cos(arg);
+                S = M_SIN[i][0] + M_SIN[i][1] * tm[k] + M_SIN[i][2] * tm2[k];
+                C = M_COS[i][0] + M_COS[i][1] * tm[k] + M_COS[i][2] * tm2[k];
+                out[k] += S * sn + C * cs;
+                if (rate)
+                    rate[k] +=
+                          (M_SIN[i][1] + 2.0 * M_SIN[i][2] * tm[k]) * 0.1 * sn
+                        + (M_COS[i][1] + 2.0 * M_COS[i][2] * tm[k]) * 0.1 * cs
+                        + (S * cs - C * sn)
+                          * (M_ARG[i][1] + 2.0 * M_ARG[i][2] * t[k]) * ASEC2RAD;
+            }
+        }
 
-    V *= ASEC2RAD;
+        for (k = 0; k < m; k++)
+            out[k] *= ASEC2RAD;
+        if (rate) {
+            for (k = 0; k < m; k++)
+                rate[k] *= ASEC2RAD / 36525.0;
+            rate += m;
+        }
 
-    if (!ignorenutation) {
-        V += nutation(jd);
-        /* printf("debug lea406,  nutation been adjusted"); */
+        jd += m;
+        out += m;
+        n -= m;
     }
-    return V;
 }
 
-/* calculate the apparent position of the Moon, it is an alias to the
- * lea406 function
- */
-double apparentmoon(double jd, int ignorenutation)
+/* apparent position of the Moon and its rate in radians per day for n
+ * epochs by the truncated lea406, the rate of nutation is left out */
+void apparentmoon_low_rate_batch(const double *jd, size_t n, double *out,
+                                 double *rate, int ignorenutation)
 {
-    return lea406(jd, ignorenutation);
+    size_t k;
+
+    lea406_low_rate_batch(jd, n, out, rate);
+    if (!ignorenutation)
+        for (k = 0; k < n; k++)
+            out[k] += nutation(jd[k]);
 }
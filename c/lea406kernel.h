@@ -0,0 +1,150 @@
+/*
+ * LEA-406 term kernel template, included by lea406simd.c once for every
+ * instruction set. Before including, define
+ *
+ *     W          number of doubles in a vector
+ *     KNAME(f)   append the instruction set suffix to a name
+ *     KTARGET    the gcc target attribute of the instruction set
+ *
+ * The vectors are gcc vector extensions, the compiler maps them to SSE2,
+ * AVX2 or AVX-512 registers according to KTARGET.
+ */
+
+#define VD KNAME(vd)
+#define VI KNAME(vi)
+
+typedef double VD __attribute__ ((vector_size (W * 8)));
+typedef long long VI __attribute__ ((vector_size (W * 8)));
+
+
+/*
+ * sine and cosine of W angles in radians
+ *
+ * Reduce x to r in [-pi/4, pi/4] by the nearest multiple q of pi/2, pi/2 is
+ * split in three parts so the reduction stays exact for |x| up to 2^29, then
+ * evaluate the Cephes minimax polynomials of sin and cos of r, and pick and
+ * sign them according to the quadrant q mod 4.
+ */
+static inline KTARGET void KNAME(vsincos)(VD x, VD *sinx, VD *cosx)
+{
+    VD y, q, r, z, s, c;
+    VI qi, swap;
+
+    /* round to nearest integer by adding 1.5 * 2^52, the low bits of the
+     * mantissa of y are then q in two's complement */
+    y = x * TWO_OVER_PI + ROUNDER;
+    q = y - ROUNDER;
+    qi = (VI) y;
+
+    r = x - q * PIO2_1;
+    r = r - q * PIO2_2;
+    r = r - q * PIO2_3;
+    z = r * r;
+
+    s = r + r * z * (SIN5 + z * (SIN4 + z * (SIN3 + z * (SIN2
+                   + z * (SIN1 + z * SIN0)))));
+    c = 1.0 - 0.5 * z + z * z * (COS5 + z * (COS4 + z * (COS3 + z * (COS2
+                               + z * (COS1 + z * COS0)))));
+
+    /* odd quadrants swap sin and cos, sin flips sign in quadrant 2 and 3,
+     * cos in quadrant 1 and 2 */
+    swap = (qi & 1) == 1;
+    *sinx = (VD) (((VI) c & swap) | ((VI) s & ~swap));
+    *sinx = (VD) ((VI) *sinx ^ ((qi & 2) << 62));
+    *cosx = (VD) (((VI) s & swap) | ((VI) c & ~swap));
+    *cosx = (VD) ((VI) *cosx ^ (((qi + 1) & 2) << 62));
+}
+
+
+/*
+ * sum LEA-406 terms from start up to end for n epochs, W terms at a time,
+ * and their time derivatives if rate is not NULL
+ */
+void KTARGET KNAME(lea406kernel)(const struct lea406_soa *tab, int start,
+                                 int end, const double *t, size_t n,
+                                 double *out, double *rate)
+{
+    int i, j;
+    size_t k;
+    double tm, tm2, arg, sn, cs, S, C;
+    VD a0, a1, a2, s0, s1, s2, c0, c1, c2, varg, vsin, vcos, vS, vC;
+    VD acc[EPOCH_BATCH], vt[EPOCH_BATCH], vtm[EPOCH_BATCH], vtm2[EPOCH_BATCH];
+    VD dacc[EPOCH_BATCH];
+
+    for (k = 0; k < n; k++) {
+        acc[k] = (VD) {0};
+        dacc[k] = acc[k];
+        vt[k] = acc[k] + t[k];
+        vtm[k] = vt[k] / 10.0;
+        vtm2[k] = vtm[k] * vtm[k];
+    }
+
+    for (i = start; i + W <= end; i += W) {
+        memcpy(&a0, tab->arg0 + i, sizeof(VD));
+        memcpy(&a1, tab->arg1 + i, sizeof(VD));
+        memcpy(&a2, tab->arg2 + i, sizeof(VD));
+        memcpy(&s0, tab->s0 + i, sizeof(VD));
+        memcpy(&s1, tab->s1 + i, sizeof(VD));
+        memcpy(&s2, tab->s2 + i, sizeof(VD));
+        memcpy(&c0, tab->c0 + i, sizeof(VD));
+        memcpy(&c1, tab->c1 + i, sizeof(VD));
+        memcpy(&c2, tab->c2 + i, sizeof(VD));
+
+        if (rate == NULL) {
+            for (k = 0; k < n; k++) {
+                varg = (a0 + vt[k] * (a1 + a2 * vt[k])) * ASEC2RAD;
+                KNAME(vsincos)(varg, &vsin, &vcos);
+                acc[k] +=   (s0 + s1 * vtm[k] + s2 * vtm2[k]) * vsin
+                          + (c0 + c1 * vtm[k] + c2 * vtm2[k]) * vcos;
+            }
+            continue;
+        }
+
+        for (k = 0; k < n; k++) {
+            varg = (a0 + vt[k] * (a1 + a2 * vt[k])) * ASEC2RAD;
+            KNAME(vsincos)(varg, &vsin, &vcos);
+            vS = s0 + s1 * vtm[k] + s2 * vtm2[k];
+            vC = c0 + c1 * vtm[k] + c2 * vtm2[k];
+            acc[k] += vS * vsin + vC * vcos;
+            /* d/dt, tm is t / 10 */
+            dacc[k] +=   (s1 + 2.0 * s2 * vtm[k]) * 0.1 * vsin
+                       + (c1 + 2.0 * c2 * vtm[k]) * 0.1 * vcos
+                       + (vS * vcos - vC * vsin)
+                         * (a1 + 2.0 * a2 * vt[k]) * ASEC2RAD;
+        }
+    }
+
+    for (k = 0; k < n; k++) {
+        out[k] = 0.0;
+        for (j = 0; j < W; j++)
+            out[k] += acc[k][j];
+
+        if (rate) {
+            rate[k] = 0.0;
+            for (j = 0; j < W; j++)
+                rate[k] += dacc[k][j];
+        }
+
+        /* the last few terms which do not fill a vector */
+        tm = t[k] / 10.0;
+        tm2 = tm * tm;
+        for (j = i; j < end; j++) {
+            arg = (tab->arg0[j] + t[k] * (tab->arg1[j] + tab->arg2[j] * t[k]))
+                  * ASEC2RAD;
+            sn = sin(arg);
+            cs = cos(arg);
+            S = tab->s0[j] + tab->s1[j] * tm + tab->s2[j] * tm2;
+            C = tab->c0[j] + tab->c1[j] * tm + tab->c2[j] * tm2;
+            out[k] += S * sn + C * cs;
+            if (rate)
+                rate[k] +=   (tab->s1[j] + 2.0 * tab->s2[j] * tm) * 0.1 * sn
+                           + (tab->c1[j] + 2.0 * tab->c2[j] * tm) * 0.1 * cs
+                           + (S * cs - C * sn)
+                             * (tab->arg1[j] + 2.0 * tab->arg2[j] * t[k])
+                             * ASEC2RAD;
+        }
+    }
+}
+
+#undef VD
+#undef VI
@@ -0,0 +1,145 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Vectorized kernels for the sum of LEA-406 terms.
+
+The same kernel is compiled for SSE2, AVX2 and AVX-512 from the template in
+lea406kernel.h, the best one the CPU supports is picked at run time through
+CPUID. The plain C kernel is the fallback, and the reference for accuracy.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "astro.h"
+
+/* pi/2 in three parts for Cody-Waite argument reduction */
+#define TWO_OVER_PI 0.63661977236758134308
+#define ROUNDER 6755399441055744.0     /* 1.5 * 2^52 */
+#define PIO2_1 1.57079625129699707031E0
+#define PIO2_2 7.54978941586159635335E-8
+#define PIO2_3 5.39030285815811905290E-15
+
+/* Cephes sin and cos polynomials for [-pi/4, pi/4] */
+#define SIN0  1.58962301576546568060E-10
+#define SIN1 -2.50507477628578072866E-8
+#define SIN2  2.75573136213857245213E-6
+#define SIN3 -1.98412698295895385996E-4
+#define SIN4  8.33333333332211858878E-3
+#define SIN5 -1.66666666666666307295E-1
+#define COS0 -1.13585365213876817300E-11
+#define COS1  2.08757008419747316778E-9
+#define COS2 -2.75573141792967388112E-7
+#define COS3  2.48015872888517045348E-5
+#define COS4 -1.38888888888730564116E-3
+#define COS5  4.16666666666665929218E-2
+
+
+/* the plain C kernel, also sums the time derivatives if rate is not NULL */
+void lea406kernel_scalar(const struct lea406_soa *tab, int start, int end,
+                         const double *t, size_t n, double *out, double *rate)
+{
+    int i;
+    size_t k;
+    double tm[EPOCH_BATCH], tm2[EPOCH_BATCH], arg, sn, cs, S, C;
+
+    for (k = 0; k < n; k++) {
+        tm[k] = t[k] / 10.0;
+        tm2[k] = tm[k] * tm[k];
+        out[k] = 0.0;
+        if (rate)
+            rate[k] = 0.0;
+    }
+
+    for (i = start; i < end; i++) {
+        for (k = 0; k < n; k++) {
+            arg = (tab->arg0[i] + t[k] * (tab->arg1[i] + tab->arg2[i] * t[k]))
+                  * ASEC2RAD;
+            /* gcc merges sin and cos of the same argument into one sincos */
+            sn = sin(arg);
+            cs = cos(arg);
+            S = tab->s0[i] + tab->s1[i] * tm[k] + tab->s2[i] * tm2[k];
+            C = tab->c0[i] + tab->c1[i] * tm[k] + tab->c2[i] * tm2[k];
+            out[k] += S * sn + C * cs;
+            if (rate)
+                rate[k] +=   (tab->s1[i] + 2.0 * tab->s2[i] * tm[k]) * 0.1 * sn
+                           + (tab->c1[i] + 2.0 * tab->c2[i] * tm[k]) * 0.1 * cs
+                           + (S * cs - C * sn)
+                             * (tab->arg1[i] + 2.0 * tab->arg2[i] * t[k])
+                             * ASEC2RAD;
+        }
+    }
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define W 2
+#define KNAME(f) f##_sse2
+#define KTARGET __attribute__ ((target ("sse2")))
+#include "lea406kernel.h"
+#undef W
+#undef KNAME
+#undef KTARGET
+
+#define W 4
+#define KNAME(f) f##_avx2
+#define KTARGET __attribute__ ((target ("avx2,fma")))
+#include "lea406kernel.h"
+#undef W
+#undef KNAME
+#undef KTARGET
+
+#define W 8
+#define KNAME(f) f##_avx512
+#define KTARGET __attribute__ ((target ("avx512f")))
+#include "lea406kernel.h"
+#undef W
+#undef KNAME
+#undef KTARGET
+
+#define HAS_X86_KERNELS 1
+#endif
+
+
+/*
+ * Find a kernel by name, "best" is the fastest kernel this CPU supports.
+ *
+ * Return:
+ *     the kernel, NULL if it is unknown or not supported by this CPU
+ */
+lea406kernel lea406kernel_find(const char *name, const char **found)
+{
+    int best = (strcmp(name, "best") == 0);
+    const char *dummy;
+
+    found = (found) ? found : &dummy;
+
+#ifdef HAS_X86_KERNELS
+    __builtin_cpu_init();
+    if ((best || strcmp(name, "avx512") == 0)
+        && __builtin_cpu_supports("avx512f")) {
+        *found = "avx512";
+        return lea406kernel_avx512;
+    }
+
+    if ((best || strcmp(name, "avx2") == 0)
+        && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        *found = "avx2";
+        return lea406kernel_avx2;
+    }
+
+    if ((best || strcmp(name, "sse2") == 0)
+        && __builtin_cpu_supports("sse2")) {
+        *found = "sse2";
+        return lea406kernel_sse2;
+    }
+#endif
+
+    if (best || strcmp(name, "scalar") == 0) {
+        *found = "scalar";
+        return lea406kernel_scalar;
+    }
+
+    return NULL;
+}
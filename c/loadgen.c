@@ -0,0 +1,232 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Load generator for lunarcald.
+
+Opens a number of connections to the daemon, each sends a request, waits
+for the answer and sends the next, for some seconds. The requests are
+conversions of random dates, 7 of 10 solar to lunar, 2 lunar to solar and
+1 the next solar term or holiday. Reports the requests per second and the
+latency seen by the clients, then the latency the daemon measured for
+itself.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#define DEFAULT_SOCKET "/tmp/lunarcald.sock"
+#define MAX_CONNS 1024
+#define LAT_SAMPLES (1 << 20)
+
+struct client {
+    int fd;
+    long sent_at;            /* ns, when the request went out */
+    char buf[512];           /* the answer so far */
+    size_t len;
+};
+
+static long latency[LAT_SAMPLES];
+static long nlatency;
+
+void usage(void);
+long now_ns(void);
+int cmp_long(const void *a, const void *b);
+int connect_to(const char *path);
+void send_request(struct client *cl);
+void run(const char *path, int nconns, double seconds);
+
+
+void usage(void)
+{
+    printf("Usage: loadgen [-s socket] [-t seconds] [connections ...]\n"
+           "  -s  the socket of lunarcald, %s by default\n"
+           "  -t  seconds of each run, 2 by default\n"
+           "  runs with 1, 16 and 256 connections by default\n",
+           DEFAULT_SOCKET);
+    exit(2);
+}
+
+
+long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* Return: socket connected to path, -1 on error */
+int connect_to(const char *path)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+void send_request(struct client *cl)
+{
+    int n, r;
+    char req[64];
+
+    r = rand() % 10;
+    if (r < 7)
+        n = snprintf(req, sizeof(req), "s %d %d %d\n", 1900 + rand() % 201,
+                     1 + rand() % 12, 1 + rand() % 28);
+    else if (r < 9)
+        n = snprintf(req, sizeof(req), "l %d %d %d 0\n", 1900 + rand() % 200,
+                     1 + rand() % 12, 1 + rand() % 29);
+    else
+        n = snprintf(req, sizeof(req), "n %d %d %d\n", 1900 + rand() % 200,
+                     1 + rand() % 12, 1 + rand() % 28);
+
+    cl->len = 0;
+    cl->sent_at = now_ns();
+    if (write(cl->fd, req, n) != n) {
+        perror("write");
+        exit(1);
+    }
+}
+
+
+/* nconns clients asking path for seconds, report the result */
+void run(const char *path, int nconns, double seconds)
+{
+    int i, n, epfd;
+    long start, end, done, p50, p99;
+    ssize_t r;
+    struct client *clients, *cl;
+    struct epoll_event ev, events[64];
+
+    clients = (struct client *) calloc(nconns, sizeof(struct client));
+    epfd = epoll_create1(0);
+    for (i = 0; i < nconns; i++) {
+        if ((clients[i].fd = connect_to(path)) == -1) {
+            perror(path);
+            exit(1);
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &clients[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &ev);
+    }
+
+    nlatency = 0;
+    done = 0;
+    start = now_ns();
+    end = start + (long) (seconds * 1e9);
+    for (i = 0; i < nconns; i++)
+        send_request(&clients[i]);
+
+    while (now_ns() < end) {
+        if ((n = epoll_wait(epfd, events, 64, 100)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (i = 0; i < n; i++) {
+            cl = (struct client *) events[i].data.ptr;
+            r = read(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - cl->len);
+            if (r <= 0) {
+                fprintf(stderr, "lunarcald closed the connection\n");
+                exit(1);
+            }
+            cl->len += r;
+            if (memchr(cl->buf, '\n', cl->len) == NULL)
+                continue;
+
+            latency[nlatency++ % LAT_SAMPLES] = now_ns() - cl->sent_at;
+            done++;
+            send_request(cl);
+        }
+    }
+    end = now_ns();
+
+    n = (nlatency < LAT_SAMPLES) ? nlatency : LAT_SAMPLES;
+    qsort(latency, n, sizeof(long), cmp_long);
+    p50 = n ? latency[n / 2] : 0;
+    p99 = n ? latency[(long) n * 99 / 100] : 0;
+    printf("%6d %10ld %12.0f %10.1f %10.1f\n", nconns, done,
+           done / ((end - start) / 1e9), p50 / 1e3, p99 / 1e3);
+
+    /* the answers still on the way are dropped with the connections */
+    for (i = 0; i < nconns; i++)
+        close(clients[i].fd);
+    close(epfd);
+    free(clients);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt, i, fd, n;
+    double seconds = 2;
+    char *path = DEFAULT_SOCKET;
+    char buf[256];
+    static const int DEFAULT_CONNS[] = {1, 16, 256};
+
+    while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+        switch (opt) {
+        case 's':
+            path = optarg;
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    srand(1);
+    printf("# %-5s %10s %12s %10s %10s\n", "conns", "requests", "req/s",
+           "p50 us", "p99 us");
+    if (optind == argc) {
+        for (i = 0; i < 3; i++)
+            run(path, DEFAULT_CONNS[i], seconds);
+    } else {
+        for (i = optind; i < argc; i++) {
+            n = atoi(argv[i]);
+            if (n < 1 || n > MAX_CONNS)
+                usage();
+            run(path, n, seconds);
+        }
+    }
+
+    /* the daemon's own view, over every request it served */
+    if ((fd = connect_to(path)) != -1 && write(fd, "t\n", 2) == 2 &&
+        (n = read(fd, buf, sizeof(buf) - 1)) > 0) {
+        buf[n] = '\0';
+        printf("# lunarcald: %s", buf);
+    }
+
+    return 0;
+}
@@ -1,35 +1,462 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "astro.h"
 #include "lunarcalbase.h"
 
+#define MAX_JOBS 64         /* max number of -j worker threads */
+#define YEARS_PER_TASK 4    /* consecutive years computed by one task */
+#define TASKS_PER_JOB 2     /* reorder buffer slots per worker thread */
+
+/*
+ * Parallel generation.
+ *
+ * The year range is cut into tasks of YEARS_PER_TASK consecutive years, so
+ * the engine of a worker can reuse the cached next year while it walks
+ * through its task. Idle workers take the next task from a shared counter.
+ * Finished tasks are parked in a reorder buffer until all tasks before them
+ * have been written, the buffer has a fixed number of slots and a worker
+ * waits before it runs too far ahead of the writer, so memory stays bounded
+ * however long the range is.
+ */
+struct task_slot {
+    int ready;
+    char *buf[MAX_EMITTERS];    /* the task in each output format */
+    size_t len[MAX_EMITTERS];
+};
+
+struct runqueue {
+    int start;           /* first year */
+    int end;             /* last year */
+    int ntasks;
+    int nslots;
+    int next_task;       /* next task to hand out */
+    int next_write;      /* next task to write */
+    time_t stamp;        /* DTSTAMP shared by all workers */
+    struct diskcache *disk;  /* cache file shared by all workers, or NULL */
+    int events;          /* EV_ flags of the engines */
+    struct emitter *out;     /* the formats to write */
+    const struct prevcal *prev;  /* years to reuse, or NULL */
+    struct task_slot *slots;
+    int failed;          /* a worker ran out of memory */
+    pthread_mutex_t lock;
+    pthread_cond_t slot_free;   /* signaled when next_write advances */
+    pthread_cond_t slot_ready;  /* signaled when a task is done */
+};
+
+void usage(void);
+int parsedate(const char *s, int *jdn);
+int add_output(struct emitter *outputs, int n, const char *spec);
+void *lunarcal_worker(void *args);
+int run_parallel(struct emitter *out, int start, int end, int jobs,
+                 time_t stamp, struct diskcache *disk, int events,
+                 const struct prevcal *prev);
+int write_sharded(const char *dir, char **specs, int n, int start, int end,
+                  int jobs, const char *cachefile, int events,
+                  const struct prevcal *prev);
+
+
+void usage(void)
+{
+    printf("Usage: lunarcal [-Fn] [-c cachefile] [-j jobs] [-u prev] "
+           "[-f format[:file]]\n"
+           "                startyear [endyear]\n"
+           "       lunarcal [-Fn] [-c cachefile] [-j jobs] [-u prev] "
+           "[-f format] -o dir\n"
+           "                [--shard=year] startyear [endyear]\n"
+           "       lunarcal [-Fn] [-f format[:file]] startdate [enddate]\n"
+           "  dates are YYYY-MM-DD, only the months they cover are computed\n"
+           "  -F  solve on the full ephemeris series only\n"
+           "  -n  no solar terms, only the months and holidays\n"
+           "  -c  keep computed years in cachefile for later runs\n"
+           "  -f  write format, ics, csv, jsonl or binary, to file or stdout,\n"
+           "      may be given several times, ics to stdout by default\n"
+           "  -o  write to directory dir instead, a file per year and format,\n"
+           "      with a manifest, --shard=year is the only sharding\n"
+           "  -u  update, take the years prev has from it as they are, prev\n"
+           "      is an earlier ics output or -o directory\n");
+    exit(2);
+}
+
+
+/*
+ * JDN of s if it is a date, YYYY-MM-DD
+ *
+ * Return: 0 if s is a date, -1 if it is a year
+ */
+int parsedate(const char *s, int *jdn)
+{
+    int year, month, day;
+
+    /* a year may start with -, a date has - after the year */
+    if (strchr(s + 1, '-') == NULL)
+        return -1;
+
+    if (sscanf(s, "%d-%d-%d", &year, &month, &day) != 3)
+        usage();
+
+    *jdn = (int) (g2jd(year, month, day) + 0.5);
+    return 0;
+}
+
+
+/*
+ * open the output given by -f spec, format[:file], as outputs[n]
+ *
+ * Return: 0 on success, -1 on error
+ */
+int add_output(struct emitter *outputs, int n, const char *spec)
+{
+    int format, fd;
+    char name[BUFSIZE];
+    const char *file;
+
+    file = strchr(spec, ':');
+    snprintf(name, sizeof(name), "%.*s",
+             (int) (file ? file - spec : strlen(spec)), spec);
+    if ((format = emit_format(name)) == -1) {
+        fprintf(stderr, "unknown format %s\n", name);
+        return -1;
+    }
+
+    fd = STDOUT_FILENO;
+    if (file && (fd = open(file + 1, O_WRONLY | O_CREAT | O_TRUNC,
+                           0644)) == -1) {
+        perror(file + 1);
+        return -1;
+    }
+
+    if (emit_open(&outputs[n], format, fd) != 0) {
+        perror("lunarcal");
+        return -1;
+    }
+    if (n > 0)
+        outputs[n - 1].next = &outputs[n];
+    return 0;
+}
+
+
+void *lunarcal_worker(void *args)
+{
+    int i, n, task, year, last, failed;
+    struct emitter w[MAX_EMITTERS], *out;
+    struct runqueue *q = (struct runqueue *) args;
+    struct task_slot *slot;
+    struct lcengine *e;
+
+    /* without an engine the tasks taken are still handed back, failed */
+    if ((e = lcengine_alloc()) != NULL) {
+        set_dtstamp(e, q->stamp);
+        use_diskcache(e, q->disk);
+        set_events(e, q->events);
+    }
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        task = q->next_task;
+        if (task >= q->ntasks) {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        q->next_task++;
+
+        while (task >= q->next_write + q->nslots)
+            pthread_cond_wait(&q->slot_free, &q->lock);
+        pthread_mutex_unlock(&q->lock);
+
+        /* the same formats as q->out, in memory, the task is skipped if one
+         * can not be opened */
+        failed = e == NULL;
+        for (n = 0, out = q->out; out; n++, out = out->next) {
+            if (emit_open(&w[n], out->format, -1) != 0)
+                failed = 1;
+            if (n > 0)
+                w[n - 1].next = &w[n];
+        }
+
+        year = q->start + task * YEARS_PER_TASK;
+        last = year + YEARS_PER_TASK - 1;
+        last = (last > q->end) ? q->end : last;
+        for (; !failed && year <= last; year++)
+            if ((q->prev == NULL || prevcal_emit(q->prev, w, year) != 0) &&
+                cn_lunarcal(e, w, year) != 0)
+                failed = 1;
+
+        pthread_mutex_lock(&q->lock);
+        q->failed |= failed;
+        slot = &q->slots[task % q->nslots];
+        for (i = 0; i < n; i++)
+            slot->buf[i] = emit_detach(&w[i], &slot->len[i]);
+        slot->ready = 1;
+        pthread_cond_broadcast(&q->slot_ready);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    lcengine_free(e);
+    return NULL;
+}
+
+
+/*
+ * compute years on jobs threads, write them to out in year order
+ *
+ * Return: 0 on success, -1 if a year could not be computed
+ */
+int run_parallel(struct emitter *out, int start, int end, int jobs,
+                 time_t stamp, struct diskcache *disk, int events,
+                 const struct prevcal *prev)
+{
+    int i, task;
+    struct emitter *em;
+    pthread_t threads[MAX_JOBS];
+    struct runqueue q;
+    struct task_slot *slot;
+
+    memset(&q, 0, sizeof(q));
+    q.start = start;
+    q.end = end;
+    q.ntasks = (end - start + YEARS_PER_TASK) / YEARS_PER_TASK;
+    q.nslots = jobs * TASKS_PER_JOB;
+    q.stamp = stamp;
+    q.disk = disk;
+    q.events = events;
+    q.out = out;
+    q.prev = prev;
+    q.slots = (struct task_slot *) calloc(q.nslots, sizeof(struct task_slot));
+    if (q.slots == NULL)
+        return -1;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.slot_free, NULL);
+    pthread_cond_init(&q.slot_ready, NULL);
+
+    for (i = 0; i < jobs; i++)
+        pthread_create(&threads[i], NULL, lunarcal_worker, &q);
+
+    for (task = 0; task < q.ntasks; task++) {
+        slot = &q.slots[task % q.nslots];
+        pthread_mutex_lock(&q.lock);
+        while (!slot->ready)
+            pthread_cond_wait(&q.slot_ready, &q.lock);
+        pthread_mutex_unlock(&q.lock);
+
+        for (i = 0, em = out; em; i++, em = em->next) {
+            emit_write(em, slot->buf[i], slot->len[i]);
+            free(slot->buf[i]);
+        }
+
+        pthread_mutex_lock(&q.lock);
+        slot->ready = 0;
+        q.next_write++;
+        pthread_cond_broadcast(&q.slot_free);
+        pthread_mutex_unlock(&q.lock);
+    }
+
+    for (i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.slot_free);
+    pthread_cond_destroy(&q.slot_ready);
+    free(q.slots);
+    return q.failed ? -1 : 0;
+}
+
+
+/*
+ * -o dir, write years start to end in the formats of specs to a file each
+ *
+ * Return: exit status
+ */
+int write_sharded(const char *dir, char **specs, int n, int start, int end,
+                  int jobs, const char *cachefile, int events,
+                  const struct prevcal *prev)
+{
+    int i, k, format, ret;
+    struct shardset ss;
+
+    memset(&ss, 0, sizeof(ss));
+    for (i = 0; i < n; i++) {
+        if ((format = emit_format(specs[i])) == -1) {
+            fprintf(stderr, "-o takes formats without a file, not %s\n",
+                    specs[i]);
+            return 2;
+        }
+
+        /* each format once */
+        for (k = 0; k < ss.nformats && ss.formats[k] != format; k++)
+            ;
+        if (k == ss.nformats)
+            ss.formats[ss.nformats++] = format;
+    }
+
+    if (cachefile && (ss.disk = diskcache_open(cachefile)) == NULL)
+        perror(cachefile);
+
+    ss.dir = dir;
+    ss.start = start;
+    ss.end = end;
+    ss.events = events;
+    ss.stamp = time(NULL);
+    ss.prev = prev;
+    ret = write_shards(&ss, jobs);
+    diskcache_close(ss.disk);
+    return ret ? 1 : 0;
+}
+
 
 int main(int argc, char *argv[])
 {
-    int start, end;
-    if (argc == 2) {
-        start = atoi(argv[1]);
-        end = start;
-    } else if (argc == 3) {
-        start = atoi(argv[1]);
-        end = atoi(argv[2]);
-    } else {
-        printf("Usage: lunarcal startyear endyear \n");
+    int start, end, jobs, opt, events, first, last, range, i, n, ret;
+    char *cachefile = NULL, *outdir = NULL, *update = NULL;
+    char *specs[MAX_EMITTERS];
+    time_t stamp;
+    struct emitter outputs[MAX_EMITTERS];
+    static const struct option longopts[] = {
+        {"shard", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+    struct lcengine *e;
+    struct diskcache *disk = NULL;
+    struct prevcal prevcal, *prev = NULL;
+
+    jobs = 1;
+    events = EV_ALL;
+    n = 0;
+    while ((opt = getopt_long(argc, argv, "Fnc:j:f:o:u:", longopts,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'F':
+            set_fidelity(FIDELITY_FULL);
+            break;
+        case 'n':
+            events = EV_HOLIDAYS;
+            break;
+        case 'c':
+            cachefile = optarg;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'f':
+            if (n == MAX_EMITTERS) {
+                printf("at most %d outputs\n", MAX_EMITTERS);
+                exit(2);
+            }
+            specs[n++] = optarg;
+            break;
+        case 'o':
+            outdir = optarg;
+            break;
+        case 'u':
+            update = optarg;
+            break;
+        case 's':
+            if (strcmp(optarg, "year") != 0)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (jobs < 1 || jobs > MAX_JOBS) {
+        printf("jobs must be between 1 and %d\n", MAX_JOBS);
         exit(2);
     }
 
-    printf("BEGIN:VCALENDAR\n"
-           "PRODID:-//Chen Wei//Chinese Lunar Calendar//EN\n"
-           "VERSION:2.0\n"
-           "CALSCALE:GREGORIAN\n"
-           "METHOD:PUBLISH\n"
-           "X-WR-CALNAME:农历\n"
-           "X-WR-TIMEZONE:Asia/Shanghai\n"
-           "X-WR-CALDESC:中国农历%d-%d, 包括节气.\n", start, end);
-    while (start <= end) {
-        cn_lunarcal(start);
-        start++;
+    if (argc - optind < 1 || argc - optind > 2)
+        usage();
+
+    range = parsedate(argv[optind], &first) == 0;
+    start = atoi(argv[optind]);
+    last = first;
+    end = start;
+    if (argc - optind == 2) {
+        if (range != (parsedate(argv[optind + 1], &last) == 0))
+            usage();
+        end = atoi(argv[optind + 1]);
     }
-    printf("END:VCALENDAR\n");
 
-    return 0;
+    if (n == 0)
+        specs[n++] = "ics";
+
+    /* read before an output may truncate it */
+    if (update) {
+        if (range)
+            usage();
+        if (prevcal_open(&prevcal, update, events) == 0)
+            prev = &prevcal;
+        else
+            fprintf(stderr, "%s: not a previous output, computing every "
+                    "year\n", update);
+    }
+
+    if (outdir) {
+        if (range)
+            usage();
+        ret = write_sharded(outdir, specs, n, start, end, jobs, cachefile,
+                            events, prev);
+        if (prev)
+            prevcal_close(prev);
+        return ret;
+    }
+
+    for (i = 0; i < n; i++)
+        if (add_output(outputs, i, specs[i]) != 0)
+            exit(1);
+
+    /* after -F, the fidelity is part of the cache file header */
+    if (cachefile && (disk = diskcache_open(cachefile)) == NULL)
+        perror(cachefile);
+
+    emit_begin(outputs, start, end, events);
+    stamp = time(NULL);
+    ret = 0;
+    if (range) {
+        if ((e = lcengine_alloc()) != NULL) {
+            set_dtstamp(e, stamp);
+            set_events(e, events);
+            cn_lunarcal_range(e, outputs, first, last);
+            lcengine_free(e);
+        } else {
+            ret = 1;
+        }
+    } else if (jobs > 1 && end > start) {
+        if (run_parallel(outputs, start, end, jobs, stamp, disk, events,
+                         prev) != 0)
+            ret = 1;
+    } else if ((e = lcengine_alloc()) == NULL) {
+        ret = 1;
+    } else {
+        set_dtstamp(e, stamp);
+        use_diskcache(e, disk);
+        set_events(e, events);
+        for (; start <= end && ret == 0; start++)
+            if ((prev == NULL || prevcal_emit(prev, outputs, start) != 0) &&
+                cn_lunarcal(e, outputs, start) != 0)
+                ret = 1;
+        lcengine_free(e);
+    }
+    emit_end(outputs);
+    diskcache_close(disk);
+    if (prev)
+        prevcal_close(prev);
+
+    if (ret)
+        fprintf(stderr, "lunarcal: out of memory\n");
+    for (i = 0; i < n; i++) {
+        if (emit_close(&outputs[i]) != 0) {
+            perror(specs[i]);
+            ret = 1;
+        }
+        if (outputs[i].fd != STDOUT_FILENO && close(outputs[i].fd) != 0) {
+            perror(specs[i]);
+            ret = 1;
+        }
+    }
+
+    return ret;
 }
@@ -6,6 +6,10 @@
 #include "astro.h"
 #include "lunarcalbase.h"
 
+#define TERM_SPREAD 4         /* days a solar term may be off its mean date */
+#define TERM_BEFORE 0         /* a solar term not solved, before a span */
+#define TERM_AFTER (1 << 24)  /* or after it, see gen_lunarspan() */
+
 static char *CN_DAY[] = {
     "", "",
     "初二", "初三", "初四", "初五", "初六", "初七", "初八", "初九",
@@ -47,14 +51,9 @@ static char *CN_HOLIDAY[] = {
     "端午", "七夕", "中元", "中秋", "重阳", "下元",
 };
 
-static double newmoons[MAX_NEWMOONS];
-static struct solarterm solarterms[MAX_SOLARTERMS];
-static int nm_before_ws_index;
-
-static struct lunarcal_cache *cached_lcs[CACHESIZE];
-static int cache_initialized = 0;  /* flag for initialized cache */
-static int cachep = 0;  /* next free location in cache */
-static int rewinded = 0;  /* cache rewinded? free pointers */
+/* ganzhi() of lunar years by lyear mod 60, the summary of every month */
+static char GANZHI[60][BUFSIZE];
+static pthread_once_t labels_once = PTHREAD_ONCE_INIT;
 
 
 /* normalize Julian Day to midnight after adjust timezone and deltaT */
@@ -75,38 +74,109 @@ double normjd(double jd, double tz)
 }
 
 
-/* initialize cache storage */
-void init_cache(void)
+/* allocate a new engine with an empty cache */
+struct lcengine *lcengine_alloc(void)
 {
-    int i;
-    struct lunarcal_cache *p;
+    struct lcengine *e;
+
+    e = (struct lcengine *) malloc(sizeof(struct lcengine));
+    if (e) {
+        memset(e, 0, sizeof(struct lcengine));
+        eventstream_init(&e->events, TZ_CN);
+        e->events_need = EV_ALL;
+        if (init_cache(e) != 0) {
+            free(e);
+            return NULL;
+        }
+        set_dtstamp(e, time(NULL));
+    }
+
+    return e;
+}
 
-    if (cache_initialized)
+
+/* release an engine and the years in its cache */
+void lcengine_free(struct lcengine *e)
+{
+    if (e == NULL)
         return;
 
-    for (i = 0; i < CACHESIZE; i++) {
-        p = (struct lunarcal_cache *) malloc(sizeof(struct lunarcal_cache));
-        memset(p, 0, sizeof(struct lunarcal_cache));
-        p->year = -1;
-        p->len = -1;
-        cached_lcs[i] = p;
-    }
+    free_cache(e);
+    free(e);
+}
+
+
+/*
+ * set the DTSTAMP used by all events printed by this engine, engines that
+ * work on parts of the same output must share the same stamp
+ */
+void set_dtstamp(struct lcengine *e, time_t t)
+{
+    fmt_dtstamp(e->dtstamp, t);
+}
+
 
-    cache_initialized = 1;
+/* t as a DTSTAMP in UTC into buf of BUFSIZE, e.g. 20200114T195532Z */
+void fmt_dtstamp(char *buf, time_t t)
+{
+    struct tm utc_time;
+
+    gmtime_r(&t, &utc_time);
+    strftime(buf, BUFSIZE, "%Y%m%dT%H%M%SZ", &utc_time);
 }
 
 
-void cn_lunarcal(int year)
+/*
+ * generate years with events, EV_ flags, from now on. Years without solar
+ * terms need about a quarter of the solar terms solved. Cached years that
+ * lack any of the events are generated again when asked for.
+ */
+void set_events(struct lcengine *e, int events)
 {
-    int i, k, len1, len2;
-    double ystart, yend;
-    struct lunarcal *thisyear[MAX_DAYS];
-    struct lunarcal *nextyear[MAX_DAYS];
-    struct lunarcal *output[MAX_DAYS];
+    e->events_need = events;
+}
 
-    init_cache();
-    len1 = get_cached_lc(thisyear, MAX_DAYS, year);
-    len2 = get_cached_lc(nextyear, MAX_DAYS, year + 1);
+
+/*
+ * write the days from JDN first to last to the emitters chained from em,
+ * only the lunar months they fall in are computed, see gen_lunarspan()
+ */
+void cn_lunarcal_range(struct lcengine *e, struct emitter *em, int first,
+                       int last)
+{
+    int year, jdn;
+    struct lunaryear ly;
+    struct lunarcal lc;
+
+    /* a day is in the lunar year of its Gregorian year or of the next */
+    for (year = jd2g(first - 0.5).year; year <= jd2g(last - 0.5).year + 1;
+         year++) {
+        if (gen_lunarspan(e, &ly, year, first, last) != 0)
+            continue;
+
+        jdn = (first > ly.months[0].start) ? first : ly.months[0].start;
+        for (; jdn <= last && jdn < ly.end; jdn++) {
+            lunaryear_day(&ly, e->events_need, jdn, &lc);
+            emit_day(em, e, &lc);
+        }
+    }
+}
+
+
+/*
+ * write the days of Gregorian year to the emitters chained from em
+ *
+ * Return: 0 on success, -1 if out of memory, nothing is written then
+ */
+int cn_lunarcal(struct lcengine *e, struct emitter *em, int year)
+{
+    int jdn, ystart, yend;
+    const struct lunaryear *thisyear, *nextyear;
+    struct lunarcal lc;
+
+    if ((thisyear = get_lunaryear(e, year)) == NULL ||
+        (nextyear = get_lunaryear(e, year + 1)) == NULL)
+        return -1;
 
     /*
      * Luncar calendar calculated above starts at Lunar calendar month 11, day
@@ -115,242 +185,482 @@ void cn_lunarcal(int year)
      * year, merge lunar calendars from this and next year results the lunar
      * calendar for this Gregorian year.
      */
-    ystart = g2jd(year, 1, 1.0);
-    yend = g2jd(year, 12, 31.0);
-    k = 0;
+    ystart = (int) (g2jd(year, 1, 1.0) + 0.5);
+    yend = (int) (g2jd(year, 12, 31.0) + 0.5);
+
     /*
      * lunar calendar after this lunar calendar month 11, day 1 shall come from
      * lc of next year
      */
-    for (i = 0; i < len1; i++) {
-        if (thisyear[i]->jd == nextyear[0]->jd)
-            break;
+    for (jdn = ystart; jdn <= yend; jdn++) {
+        if (jdn < nextyear->months[0].start)
+            lunaryear_day(thisyear, e->events_need, jdn, &lc);
+        else
+            lunaryear_day(nextyear, e->events_need, jdn, &lc);
+        emit_day(em, e, &lc);
+    }
+    return 0;
+}
 
-        if (thisyear[i]->jd >= ystart)
-            output[k++] = thisyear[i];
+
+/*
+ * the lunar calendar of year, generated if it is not in cache. The result
+ * stays valid until the cache evicts it, which takes at least capacity - 1
+ * other years.
+ *
+ * Return: NULL if out of memory
+ */
+const struct lunaryear *get_lunaryear(struct lcengine *e, int year)
+{
+    struct lunaryear *ly;
+
+    if ((ly = cache_find(e, year)) != NULL) {
+        if ((ly->events & e->events_need) == e->events_need)
+            return ly;
+    } else if ((ly = cache_add(e, year)) == NULL) {
+        return NULL;
     }
 
-    for (i = 0; k < MAX_DAYS && i < len2 && nextyear[i]->jd <= yend; k++, i++)
-        output[k] = nextyear[i];
+    /* not in cache or with fewer events, read or generate the year */
+    load_lunaryear(e, ly, year);
+    return ly;
+}
+
 
-    print_lunarcal(output, k);
+/* read year into ly from the cache file of e, or generate and save it */
+void load_lunaryear(struct lcengine *e, struct lunaryear *ly, int year)
+{
+    if (e->disk == NULL || diskcache_get(e->disk, year, ly) != 0
+        || (ly->events & e->events_need) != e->events_need) {
+        gen_lunaryear(e, ly, year);
+        if (e->disk)
+            diskcache_put(e->disk, ly);
+    }
 }
 
 
-int get_cache_index(int year)
+/* read and save years in cache file dc, NULL stops using it */
+void use_diskcache(struct lcengine *e, struct diskcache *dc)
+{
+    e->disk = dc;
+}
+
+
+/*
+ * the lunar year that gives the lunar date of day jdn in Gregorian year, the
+ * same one cn_lunarcal() prints it from
+ *
+ * Return: NULL if out of memory
+ */
+static const struct lunaryear *lunaryear_of(struct lcengine *e, int year,
+                                            int month, int jdn)
+{
+    const struct lunaryear *ly;
+
+    /* month 11, day 1 comes after the middle of November */
+    if (month >= 11) {
+        ly = get_lunaryear(e, year + 1);
+        if (ly == NULL || jdn >= ly->months[0].start)
+            return ly;
+    }
+    return get_lunaryear(e, year);
+}
+
+
+/*
+ * convert Gregorian date to lunar calendar date, the day is normalized as
+ * g2jd() does, e.g. February 30 is March 1 or 2. Only the year the date falls
+ * in, and the year after in November or December, are generated if they are
+ * not in cache.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int solar2lunar(struct lcengine *e, int year, int month, int day,
+                struct lunarcal *lc)
+{
+    int jdn;
+    const struct lunaryear *ly;
+
+    if (month < 1 || month > 12 || day < 1 || day > 31)
+        return -1;
+
+    jdn = (int) (g2jd(year, month, day) + 0.5);
+    if ((ly = lunaryear_of(e, year, month, jdn)) == NULL)
+        return -1;
+    return lunaryear_day(ly, e->events_need, jdn, lc);
+}
+
+
+/*
+ * convert lunar calendar date to Gregorian date, is_lm asks for the day in
+ * the leap month of that number
+ *
+ * Return: 0 on success, -1 if lyear has no such month or the month has no
+ *         such day
+ */
+int lunar2solar(struct lcengine *e, int lyear, int month, int day, int is_lm,
+                GregorianDate *g)
 {
     int i;
+    const struct lunaryear *ly;
+    const struct lunarmonth *lm;
+
+    if (month < 1 || month > 12 || day < 1 || day > 30)
+        return -1;
+
+    /* month 11 and 12 of lyear are at the start of the next year */
+    if ((ly = get_lunaryear(e, (month >= 11) ? lyear + 1 : lyear)) == NULL)
+        return -1;
+    for (i = 0; i < ly->nmonths; i++) {
+        lm = &ly->months[i];
+        if (lm->lyear != lyear || lm->month != month || lm->is_lm != !!is_lm)
+            continue;
+
+        if (lm->start + day > (lm + 1)->start)
+            return -1;
 
-    for (i = 0; i < CACHESIZE; i++)
-        if (cached_lcs[i]->year == year)
-            return i;
+        *g = jd2g(lm->start + day - 1.5);
+        return 0;
+    }
 
     return -1;
 }
 
 
-int get_cached_lc(struct lunarcal *lcs[], int len, int year)
+/*
+ * local date of the new moon of lunation k. In a span they are solved only
+ * as asked for, see plan_newmoons().
+ */
+static double nm_date(struct lcengine *e, long k)
 {
-    int i, k, lc_days;
+    double jd;
 
-    for (i = 0; i < len; i++)
-        lcs[i] = NULL;
+    if (!e->sparse)
+        return normjd(stream_newmoon(&e->events, k), TZ_CN);
 
-    if ((k = get_cache_index(year)) != -1) {
-        for (i = 0; i < cached_lcs[k]->len; i++)
-            lcs[i] = cached_lcs[k]->lcs[i];
+    stream_newmoons(&e->events, &k, 1, &jd);
+    return normjd(jd, TZ_CN);
+}
 
-        return cached_lcs[k]->len;
-    }
 
-    /* not in cache, generate a new lunar calendar */
-    lc_days = gen_lunar_calendar(lcs, len, year);
+/* whether solar terms are solved in order, or only as asked for */
+static int terms_in_order(struct lcengine *e)
+{
+    return (e->events_need & EV_SOLARTERMS) && !e->sparse;
+}
+
 
-    add_cache(lcs, lc_days);
+/*
+ * local date of solar term number n. Without EV_SOLARTERMS, or in a span,
+ * the terms are solved only as asked for, see plan_terms().
+ */
+static double st_date(struct lcengine *e, long n)
+{
+    double jd;
+
+    if (terms_in_order(e))
+        return normjd(stream_solarterm(&e->events, n), TZ_CN);
 
-    return lc_days;
+    stream_solarterms(&e->events, &n, 1, &jd);
+    return normjd(jd, TZ_CN);
 }
 
 
-void add_cache(struct lunarcal *lcs[], int len)
+/*
+ * solve in one batch the solar terms nums, in increasing order, that a year
+ * is about to use. Solved in order, every term is solved anyway.
+ */
+static void plan_terms(struct lcengine *e, const long nums[], int count)
 {
-    int i;
-    struct lunarcal_cache *p;
+    double jds[MAX_SOLARTERMS];
 
-    if (cachep >= CACHESIZE) {
-        cachep = 0;
-        rewinded = 1;
-    }
+    if (!terms_in_order(e) && count > 0)
+        stream_solarterms(&e->events, nums, count, jds);
+}
 
-    p = cached_lcs[cachep];
-    if (rewinded)
-        for (i = 0; i < p->len; i++)
-            free(p->lcs[i]);
 
-    for (i = 0; i < len; i++)
-        p->lcs[i] = lcs[i];
+/* as plan_terms(), for the new moons of lunations first to last in a span */
+static void plan_newmoons(struct lcengine *e, long first, long last)
+{
+    int i, count;
+    long nums[MAX_LUNARMONTHS + 4];
+    double jds[MAX_LUNARMONTHS + 4];
 
-    /* the first day in lcs is lc month 11, day 1 of previous lc year */
-    p->year = lcs[0]->lyear + 1;
-    p->len = len;
-    cachep++;
+    count = (int) (last - first + 1);
+    if (!e->sparse || count < 1 || count > MAX_LUNARMONTHS + 4)
+        return;
+
+    for (i = 0; i < count; i++)
+        nums[i] = first + i;
+    stream_newmoons(&e->events, nums, count, jds);
 }
 
 
-/* find all solarterms and newmoons related to this years lc */
-void update_solarterms_newmoons(int year)
+/*
+ * number month i, from 0 for month 11, of a lunar year with leapmonth as
+ * returned by find_leap(). lyear is the lunar year of the month before, it
+ * is advanced on 正月.
+ */
+static void number_month(struct lunarmonth *lm, int i, int leapmonth,
+                         int *lyear)
 {
-    int i;
-    double jd_nm, est_nm;
-    int start_solarterm_lon = -120;  /* 小雪 of last year */
-
-    /* search solar terms start from 小雪 of last year */
-    for (i = 0; i < MAX_SOLARTERMS; i++) {
-        solarterms[i].longitude = start_solarterm_lon + i * 15;
-        solarterms[i].jd = normjd(
-                            solarterm(year, (double) solarterms[i].longitude),
-                            TZ_CN);
-    }
+    int month;
 
-    /* search 15 newmoons start 30 days before last Winter Solstice */
-    est_nm = solarterms[2].jd - 30;
-    for (i = 0; i < MAX_NEWMOONS; i++) {
-        jd_nm = newmoon(est_nm);
-        newmoons[i] = normjd(jd_nm, TZ_CN);
-        est_nm = jd_nm + SYNODIC_MONTH;
-    }
+    lm->is_lm = (leapmonth && i == leapmonth);
+
+    /* adjust leapmonth */
+    month = (leapmonth && i >= leapmonth) ? i - 1 : i;
+
+    /*
+     * month count start from Winter Month,
+     * month 0 is lunar calendar month 11,
+     * month 1 is lc month 12,
+     * month 2 is lc month  1 ...
+     * convert them to month 1 to 12
+     */
+    if (month > 1)
+        month -= 1;
+    else
+        month += 11;
+
+    if (month == 1)
+        *lyear += 1;  /* 正月初一 starts a new lc year */
+
+    lm->month = month;
+    lm->lyear = *lyear;
 }
 
 
-/* mark year, month and day number, plus solarterms and holiday */
-int gen_lunar_calendar(struct lunarcal *lcs[], int len, int year)
+/*
+ * the lunation that starts lunar calendar month 11 of the previous year, the
+ * month the Winter Solstice of the previous Gregorian year falls in
+ */
+long winter_month(struct lcengine *e, int year)
 {
-    int i, k, m, n;
-    int leapmonth, lyear, month;
-    int is_lm;
-    double lc_november1st, jd, end;
-    struct lunarcal *lc;
-    GregorianDate g;
+    long k;
+    double ws = st_date(e, stream_winter_solstice(year - 1));
 
-    update_solarterms_newmoons(year);
-    end = solarterms[26].jd;  /* ends with Winter Solstic */
-    n = 0;
-    month = 0;
-    leapmonth = find_leap();
+    /* the true new moon is within a day of the mean one, so the lunation
+     * before the nearest mean new moon starts no later than ws */
+    k = (long) lunation(ws) - 1;
+    while (nm_date(e, k + 1) <= ws)
+        k++;
 
-    /* start from month 11 of previous lunar calendar year */
-    lc_november1st = newmoons[nm_before_ws_index];
-    g = jd2g(lc_november1st);
-    lyear = g.year;
-    for (m = nm_before_ws_index; m < MAX_NEWMOONS - 1; m++) {
-        month = m - nm_before_ws_index;
-
-        is_lm = 0;
-        if (leapmonth && month == leapmonth)
-            is_lm = 1;
-
-        /* adjust leapmonth */
-        if (leapmonth && month >= leapmonth)
-            month -= 1;
-
-        /*
-         * month count start from Winter Month,
-         * month 0 is lunar calendar month 11,
-         * month 1 is lc month 12,
-         * month 2 is lc month  1 ...
-         * convert them to month 1 to 12
-         */
-        if (month > 1)
-            month -= 1;
-        else
-            month += 11;
-
-        if (month == 1)
-            lyear += 1;  /* 正月初一 starts a new lc year */
-
-        for (i = 0, jd = newmoons[m]; jd < newmoons[m + 1] && jd < end; i++) {
-            lc = lcalloc(jd);
-            lc->lyear = lyear;
-            lc->month = month;
-            lc->day = i + 1;
-            lc->is_lm = is_lm;
-            lcs[n++] = lc;
-            jd += 1.0;
-        }
+    return k;
+}
+
+
+/* find the months of year, with their lunar year and month number */
+void gen_lunaryear(struct lcengine *e, struct lunaryear *ly, int year)
+{
+    int i, n, leapmonth, lyear;
+    long m, k11, st_first, nums[3];
+    double jd, end;
+    struct lunarmonth *lm;
+
+    /* solar terms start from 小雪 of last year, ask for it first so the
+     * event stream moves forward only. Without EV_SOLARTERMS the months
+     * need only the two Winter Solstices, and 寒食 needs 清明. */
+    st_first = stream_winter_solstice(year - 1) - 2;
+    if (e->events_need & EV_SOLARTERMS) {
+        st_date(e, st_first);
+    } else {
+        n = 0;
+        nums[n++] = stream_winter_solstice(year - 1);
+        if (e->events_need & EV_HOLIDAYS)
+            nums[n++] = st_first + QINGMING;
+        nums[n++] = stream_winter_solstice(year);
+        plan_terms(e, nums, n);
+    }
+
+    /* ends with Winter Solstic */
+    end = st_date(e, stream_winter_solstice(year));
+    k11 = winter_month(e, year);
+    leapmonth = find_leap(e, year, k11);
+
+    /* clear the unused months too, so a year is the same bytes every time */
+    memset(ly, 0, sizeof(struct lunaryear));
+    ly->year = year;
+    ly->events = e->events_need;
+    ly->leapmonth = leapmonth;
+    ly->end = (int) (end + 0.5);
+    ly->newyear = -1;
 
-        if (jd > end)
+    /* start from month 11 of previous lunar calendar year */
+    lyear = jd2g(nm_date(e, k11)).year;
+    for (i = 0, m = k11; i < MAX_LUNARMONTHS; i++, m++) {
+        jd = nm_date(e, m);
+        if (jd >= end)
             break;
+
+        lm = &ly->months[i];
+        lm->start = (int) (jd + 0.5);
+        number_month(lm, i, leapmonth, &lyear);
+        if (lm->month == 1 && !lm->is_lm)
+            ly->newyear = lm->start;
     }
+    ly->nmonths = i;
+    ly->months[i].start = (int) (nm_date(e, m) + 0.5);
+
+    if (e->events_need & EV_SOLARTERMS)
+        for (i = 0; i < MAX_SOLARTERMS - 1; i++)
+            ly->solarterms[i] = (int) (st_date(e, st_first + i) + 0.5);
+    else if (e->events_need & EV_HOLIDAYS)
+        ly->solarterms[QINGMING] = (int) (st_date(e, st_first + QINGMING)
+                                          + 0.5);
+}
 
-    /* mark solarterms */
-    for (i = 0; i < MAX_SOLARTERMS - 1; i++) {
-        if (solarterms[i].jd >= lc_november1st) {
-            k = (int) (solarterms[i].jd - lc_november1st);
-            if (lcs[k])
-                lcs[k]->solarterm = i;
-        }
+
+/*
+ * fill lc with day jdn of the lunar year ly, the month is found by a binary
+ * search on the month starts. Only the events in EV_ flags events are
+ * labelled, a year from a cache may have more than asked for.
+ *
+ * Return: 0 on success, -1 if jdn is not in ly
+ */
+int lunaryear_day(const struct lunaryear *ly, int events, int jdn,
+                  struct lunarcal *lc)
+{
+    int lo, hi, mid;
+    const struct lunarmonth *lm;
+
+    events &= ly->events;
+
+    if (jdn < ly->months[0].start || jdn >= ly->end)
+        return -1;
+
+    lo = 0;
+    hi = ly->nmonths - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (ly->months[mid].start <= jdn)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
 
-    /* mark Traditional Chinese holiday */
-    mark_holiday(lcs, n);
+    lm = &ly->months[lo];
+    lcinit(lc, jdn - 0.5);
+    lc->lyear = lm->lyear;
+    lc->month = lm->month;
+    lc->day = jdn - lm->start + 1;
+    lc->is_lm = lm->is_lm;
+
+    /* solar terms are about 15 days apart, start from the nearest guess */
+    if (events & EV_SOLARTERMS) {
+        lo = (jdn - ly->solarterms[0]) * 2 / 31;
+        lo = (lo < 0) ? 0 : (lo > MAX_SOLARTERMS - 2) ? MAX_SOLARTERMS - 2
+                                                       : lo;
+        while (lo > 0 && ly->solarterms[lo] > jdn)
+            lo--;
+        while (lo < MAX_SOLARTERMS - 2 && ly->solarterms[lo + 1] <= jdn)
+            lo++;
+        if (ly->solarterms[lo] == jdn)
+            lc->solarterm = lo;
+    }
 
-    return n;
+    lc->holiday = find_holiday(lc, (events & EV_HOLIDAYS)
+                                   ? ly->solarterms[QINGMING] : 0,
+                               ly->newyear);
+    return 0;
 }
 
 
 /*
- * mark traditional chinese holiday
+ * traditional chinese holiday of day lc, qingming and newyear are the JDN of
+ * 清明 and 正月初一 of its year
  *
  * 腊八节(腊月初八)     除夕(腊月的最后一天)     春节(一月一日)
  * 元宵节(一月十五日)   寒食节(清明的前一天)     端午节(五月初五)
  * 七夕节(七月初七)     中元节(七月十五日)       中秋节(八月十五日)
  * 重阳节(九月九日)     下元节(十月十五日)
+ *
+ * Return: index into CN_HOLIDAY, -1 if not a holiday
  */
-void mark_holiday(struct lunarcal *lcs[], int len)
+int find_holiday(const struct lunarcal *lc, int qingming, int newyear)
 {
-    int i;
-    struct lunarcal *lc;
+    if (qingming == (int) lc->jdn + 1)
+        return 4;                    /* 寒食 */
+
+    if (newyear == (int) lc->jdn + 1)
+        return 1;                    /* 除夕 */
+
+    if (lc->is_lm)
+        return -1;
+
+    switch (lc->month * 100 + lc->day) {
+    case 1208:
+        return 0;                    /* 腊八 */
+    case 101:
+        return 2;                    /* 春节 */
+    case 115:
+        return 3;                    /* 元宵 */
+    case 505:
+        return 5;                    /* 端午 */
+    case 707:
+        return 6;                    /* 七夕 */
+    case 715:
+        return 7;                    /* 中元 */
+    case 815:
+        return 8;                    /* 中秋 */
+    case 909:
+        return 9;                    /* 重阳 */
+    case 1015:
+        return 10;                   /* 下元 */
+    }
 
-    for (i = 0; i < len; i++) {
-        lc = lcs[i];
-        if (lc->solarterm == 9)  /* 清明 */
-            lcs[i - 1]->holiday = 4;     /* 寒食 */
+    return -1;
+}
 
-        if (lc->is_lm)
-            continue;
 
-        if (lc->month == 12 && lc->day == 8) {
-            lc->holiday = 0;             /* 腊八 index into CN_HOLIDAY */
-            i += 15;            /* fastforward */
-        } else if (lc->month == 1 && lc->day == 1) {
-            lcs[i - 1]->holiday = 1;     /* 除夕 */
-            lc->holiday = 2;             /* 春节 */
-            lcs[i + 14]->holiday = 3;    /* 元宵 */
-            i += 20;        /* fastforward to 清明 */
-        } else if (lc->month == 5 && lc->day == 5) {
-            lc->holiday = 5;             /* 端午 */
-            i += 2 * 27;
-        } else if (lc->month == 7 && lc->day == 7) {
-            lc->holiday = 6;             /* 七夕 */
-            lcs[i + 8]->holiday = 7;     /* 中元 */
-            i += 27;
-        } else if (lc->month == 8 && lc->day == 15) {
-            lc->holiday = 8;             /* 中秋 */
-            i += 20;
-        } else if (lc->month == 9 && lc->day == 9) {
-            lc->holiday = 9;             /* 重阳 */
-            i += 27;
-        } else if (lc->month == 10 && lc->day == 15) {
-            lc->holiday = 10;            /* 下元 */
-            break;
+/*
+ * the leap month of a leap year, as find_leap(), if it is one of the months
+ * from lunation k11 to kmax. 0 if it is later.
+ */
+static int leap_scan(struct lcengine *e, int year, long k11, long kmax)
+{
+    int k, is_leap;
+    long i, n, st_first, st_last, nums[MAX_SOLARTERMS];
+    double start, next, jd;
+
+    /*
+     * the leap month is the first lunar calendar month which does NOT contain
+     * solar terms that is multiple of 30 degrees, which are the even solar
+     * term numbers. Only those are needed, up to about one a month.
+     */
+    st_first = stream_winter_solstice(year - 1) - 2;  /* 小雪 of last year */
+    st_last = stream_winter_solstice(year);
+    plan_newmoons(e, k11, kmax + 1);
+    for (n = st_first, k = 0; n <= st_last && k <= kmax - k11 + 2; n += 2)
+        nums[k++] = n;
+    plan_terms(e, nums, k);
+
+    n = st_first;
+    for (i = k11; i <= kmax; i++) {
+        is_leap = 1;
+        start = nm_date(e, i);
+        next = nm_date(e, i + 1);
+        for (; n <= st_last; n += 2) {
+            jd = st_date(e, n);
+            if (jd >= next)
+                break;
+
+            if (jd >= start)
+                is_leap = 0;
         }
+        n = (n - 2 < st_first) ? st_first : n - 2;
 
+        if (is_leap)
+            return i - k11;
     }
+
+    return 0;
 }
 
 
 /*
- * find last newmoon before Winter Solstic and determin the leapmonth
+ * determin the leapmonth of the lunar calendar year from month 11 of last
+ * year, which starts with lunation k11
  *
  * Return: 0 if not a leap year
  *         values other than 0 indicate leapmonth, count from lc month
@@ -360,76 +670,145 @@ void mark_holiday(struct lunarcal *lcs[], int len)
  *             3: leap month 1, 闰正月, three month after Winter Month
  *             ...
  */
-int find_leap(void)
+int find_leap(struct lcengine *e, int year, long k11)
 {
-    int nmcount, is_leap, leapmonth, i, n;
-    double ws1 = solarterms[2].jd;   /* Winter Solstic of last year */
-    double ws2 = solarterms[26].jd;  /* Winter Solstic of this year */
+    int nmcount;
+    long i;
+    double ws2 = st_date(e, stream_winter_solstice(year));  /* this year */
 
-    /*
-     * find the last new moon before first Winter Solstic
-     * the lunar calendar month that Winter Solstic belongs is always month 11,
-     */
-    for (i = 1; i < MAX_NEWMOONS; i++)
-        if (newmoons[i] > ws1) {
-            nm_before_ws_index = i - 1;
-            break;
-        }
-
-    /* count newmoons between two Winter Solstice */
+    /* count newmoons between two Winter Solstice, the new moons after k11
+     * are all after the first one */
     nmcount = 0;
-    for (i = 0; i < MAX_NEWMOONS; i++)
-        if (newmoons[i] > ws1 && newmoons[i] <= ws2)
-            nmcount += 1;
+    for (i = k11 + 1; nm_date(e, i) <= ws2; i++)
+        nmcount += 1;
 
     /* leap year has more than 12 newmoons between two Winter Solstice */
-    leapmonth = 0;
     if (nmcount <= 12)
-        return leapmonth;
+        return 0;
 
-    /*
-     * the leap month is the first lunar calendar month which does NOT contain
-     * solar terms that is multiple of 30 degrees
-     */
-    int cur_st = 0;
-    for (i = nm_before_ws_index; i < MAX_NEWMOONS - 1; i++) {
-        is_leap = 1;
-        for (n = cur_st; n < MAX_SOLARTERMS; n++) {
-            if (solarterms[n].jd >= newmoons[i + 1])
-                break;
+    return leap_scan(e, year, k11, k11 + MAX_LUNARMONTHS - 1);
+}
 
-            if (solarterms[n].jd >= newmoons[i] &&
-                solarterms[n].longitude % 30 == 0)
-                    is_leap = 0;
-        }
-        cur_st = (n - 1) < 0 ? 0 : n - 1;
 
-        if (is_leap) {
-            leapmonth = i - nm_before_ws_index;
-            break;
-        }
-    }
+/* the lunation from kmin to kmax that day jdn falls in, kmin or kmax if none */
+static long lunation_of(struct lcengine *e, int jdn, long kmin, long kmax)
+{
+    long k;
 
-    return leapmonth;
+    k = (long) lunation(jdn - 0.5) - 1;
+    k = (k < kmin) ? kmin : (k > kmax) ? kmax : k;
+    while (k > kmin && nm_date(e, k) + 0.5 > jdn)
+        k--;
+    while (k < kmax && nm_date(e, k + 1) + 0.5 <= jdn)
+        k++;
+
+    return k;
 }
 
 
-struct lunarcal *lcalloc(double jd)
+/*
+ * the months of lunar year year that days first to last fall in, numbered
+ * as in gen_lunaryear(). Days from month 11 on are left to the next year, as
+ * cn_lunarcal() does. Only the new moons and solar terms of those months are
+ * solved, with what the leap month before them depends on. Solar terms more
+ * than TERM_SPREAD days out of first to last are set to TERM_BEFORE or
+ * TERM_AFTER, so they still come in order.
+ *
+ * Return: 0 on success, -1 if no day from first to last is in year
+ */
+int gen_lunarspan(struct lcengine *e, struct lunaryear *ly, int year,
+                  int first, int last)
 {
-    struct lunarcal *p;
+    int i, n, lo, hi, lyear, leapmonth, terms;
+    long k, k11, knext, kfrom, kto, st_first, nums[MAX_SOLARTERMS];
+    double ws, est;
+    struct lunarmonth lm;
+
+    e->sparse = 1;
+    st_first = stream_winter_solstice(year - 1) - 2;
+    nums[0] = stream_winter_solstice(year - 1);
+    nums[1] = stream_winter_solstice(year);
+    plan_terms(e, nums, 2);
+
+    /* the new moons around the days first to last, in one batch */
+    k11 = winter_month(e, year);
+    kfrom = (long) lunation(first - 0.5) - 2;
+    kto = (long) lunation(last - 0.5) + 2;
+    plan_newmoons(e, (kfrom < k11) ? k11 : kfrom,
+                  (kto > k11 + MAX_LUNARMONTHS) ? k11 + MAX_LUNARMONTHS : kto);
+
+    knext = winter_month(e, year + 1);
+    if (last < nm_date(e, k11) + 0.5 || first >= nm_date(e, knext) + 0.5) {
+        e->sparse = 0;
+        return -1;
+    }
+
+    kfrom = lunation_of(e, first, k11, knext - 1);
+    kto = lunation_of(e, last, k11, knext - 1);
 
-    p = (struct lunarcal *) malloc(sizeof(struct lunarcal));
-    if (p) {
-        p->jd = jd;
-        p->solarterm = -1;
-        p->lyear = -1;
-        p->month = -1;
-        p->day = -1;
-        p->holiday = -1;
-        p->is_lm = 0;
+    /* a month after kto may be 正月, whose eve is in the span */
+    leapmonth = 0;
+    if (knext - k11 > 12)
+        leapmonth = leap_scan(e, year, k11, kto + 1);
+
+    memset(ly, 0, sizeof(struct lunaryear));
+    ly->year = year;
+    ly->events = e->events_need;
+    ly->leapmonth = leapmonth;
+    ly->newyear = -1;
+
+    plan_newmoons(e, kfrom, kto + 1);
+    lyear = jd2g(nm_date(e, k11)).year;
+    for (i = 0, k = k11; k <= kto + 1; i++, k++) {
+        number_month(&lm, i, leapmonth, &lyear);
+        if (k < kfrom)
+            continue;
+
+        lm.start = (int) (nm_date(e, k) + 0.5);
+        if (lm.month == 1 && !lm.is_lm)
+            ly->newyear = lm.start;
+        ly->months[k - kfrom] = lm;
+    }
+    ly->nmonths = kto - kfrom + 1;
+    ly->end = ly->months[ly->nmonths].start;
+
+    /* solar terms near the days asked for, about 15.2 days apart from the
+     * Winter Solstice, and 清明 the day after one of them */
+    lo = (first > ly->months[0].start) ? first : ly->months[0].start;
+    hi = (last < ly->end - 1) ? last : ly->end - 1;
+    ws = st_date(e, stream_winter_solstice(year - 1)) + 0.5;
+    n = 0;
+    for (i = 0; i < MAX_SOLARTERMS - 1; i++) {
+        est = ws + (i - 2) * TROPICAL_YEAR / 24;
+        terms = (e->events_need & EV_SOLARTERMS)
+                && est > lo - TERM_SPREAD && est < hi + TERM_SPREAD;
+        terms |= i == QINGMING && (e->events_need & EV_HOLIDAYS)
+                 && est > lo + 1 - TERM_SPREAD && est < hi + 1 + TERM_SPREAD;
+        if (terms)
+            nums[n++] = st_first + i;
+        else
+            ly->solarterms[i] = (est < lo) ? TERM_BEFORE : TERM_AFTER;
     }
 
-    return p;
+    plan_terms(e, nums, n);
+    for (i = 0; i < n; i++)
+        ly->solarterms[nums[i] - st_first] = (int) (st_date(e, nums[i]) + 0.5);
+
+    e->sparse = 0;
+    return 0;
+}
+
+
+/* initialize a day at JD jd, which is midnight */
+void lcinit(struct lunarcal *lc, double jd)
+{
+    lc->jdn = (unsigned int) (jd + 0.5);
+    lc->solarterm = -1;
+    lc->lyear = -1;
+    lc->month = -1;
+    lc->day = -1;
+    lc->holiday = -1;
+    lc->is_lm = 0;
 }
 
 
@@ -445,55 +824,55 @@ void ganzhi(char *buf, size_t buflen, int lyear)
 }
 
 
-void print_lunarcal(struct lunarcal *lcs[], int len)
+/* name of solar term index solarterm of a lunarcal, e.g. 冬至 */
+const char *solarterm_name(int solarterm)
+{
+    return CN_SOLARTERM[solarterm];
+}
+
+
+/* name of holiday index holiday of a lunarcal, e.g. 春节 */
+const char *holiday_name(int holiday)
+{
+    return CN_HOLIDAY[holiday];
+}
+
+
+/* the 60 year names, made once for all threads */
+static void init_labels(void)
 {
     int i;
-    char isodate[BUFSIZE], dtstart[BUFSIZE], dtend[BUFSIZE];
-    char summary[BUFSIZE], utcstamp[BUFSIZE];
-    struct lunarcal *lc;
-    struct tm *utc_time;
-    time_t t = time(NULL);
-
-    utc_time = gmtime(&t);
-    memset(utcstamp, 0, BUFSIZE);
-    sprintf(utcstamp, "%04d%02d%02dT%02d%02d%02dZ",
-            1900 + utc_time->tm_year, 1 + utc_time->tm_mon, utc_time->tm_mday,
-            utc_time->tm_hour, utc_time->tm_min, utc_time->tm_sec);
-
-    for (i = 0; i < len; i++) {
-        lc = lcs[i];
-        jdftime(isodate, lc->jd, "%y-%m-%d", 0, 0);
-        jdftime(dtstart, lc->jd, "%y%m%d", 0, 0);
-        jdftime(dtend, lc->jd, "%y%m%d", 24, 0);
-
-        memset(summary, 0, BUFSIZE);
-        if (lc->day == 1) {
-            ganzhi(summary, BUFSIZE, lc->lyear);
-            if (lc->is_lm)
-                strcat(summary, "閏");
-
-            strcat(summary, CN_MON[lc->month]);
-        } else {
-            sprintf(summary, "%s", CN_DAY[lc->day]);
-        }
 
-        if (lc->solarterm != -1) {
-            strcat(summary, " ");
-            strcat(summary, CN_SOLARTERM[lc->solarterm]);
-        }
+    for (i = 0; i < 60; i++)
+        ganzhi(GANZHI[i], BUFSIZE, i);
+}
 
-        if (lc->holiday != -1) {
-            strcat(summary, " ");
-            strcat(summary, CN_HOLIDAY[lc->holiday]);
-        }
 
-        printf("BEGIN:VEVENT\n"
-               "DTSTAMP:%s\n"
-               "UID:%s-lc@infinet.github.io\n"
-               "DTSTART;VALUE=DATE:%s\n"
-               "DTEND;VALUE=DATE:%s\n"
-               "STATUS:CONFIRMED\n"
-               "SUMMARY:%s\n"
-               "END:VEVENT\n", utcstamp, isodate, dtstart, dtend, summary);
-     }
+/* the SUMMARY of day lc, e.g. 丙申[猴]正月 春节 */
+size_t lunarday_summary(char *summary, const struct lunarcal *lc)
+{
+    char *p;
+
+    pthread_once(&labels_once, init_labels);
+    if (lc->day == 1) {
+        p = stpcpy(summary, GANZHI[(lc->lyear % 60 + 60) % 60]);
+        if (lc->is_lm)
+            p = stpcpy(p, "閏");
+
+        p = stpcpy(p, CN_MON[lc->month]);
+    } else {
+        p = stpcpy(summary, CN_DAY[lc->day]);
+    }
+
+    if (lc->solarterm != -1) {
+        *p++ = ' ';
+        p = stpcpy(p, CN_SOLARTERM[lc->solarterm]);
+    }
+
+    if (lc->holiday != -1) {
+        *p++ = ' ';
+        p = stpcpy(p, CN_HOLIDAY[lc->holiday]);
+    }
+
+    return p - summary;
 }
@@ -1,54 +1,419 @@
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
 #define MAX_SOLARTERMS 27
-#define MAX_NEWMOONS 15
-#define MAX_DAYS 450
-#define CACHESIZE 3
+#define MAX_LUNARMONTHS 14  /* lunar months from one month 11 to the next */
+#define CACHESIZE 16   /* default years kept in the cache of an engine */
+#define CACHE_MIN 2    /* cn_lunarcal() uses two years at a time */
 #define BUFSIZE 32
 #define TZ_CN 8
+#define QINGMING 9     /* 清明 in lunaryear.solarterms */
 
-struct solarterm {
-    double jd;
-    int longitude;
-};
+/*
+ * events a lunar year is generated with besides its months, which need only
+ * the new moons, the Winter Solstices and in a leap year the 12 principal
+ * solar terms. See set_events().
+ */
+#define EV_SOLARTERMS 1   /* all 24 solar terms, to name the days */
+#define EV_HOLIDAYS 2     /* 清明, the date of 寒食 */
+#define EV_ALL (EV_SOLARTERMS | EV_HOLIDAYS)
+
+#define DISKCACHE_MAGIC "LUNARCAL"
+#define DISKCACHE_VERSION 2
+#define DISKCACHE_FIRST 1000   /* years kept in a cache file */
+#define DISKCACHE_LAST 3000
+#define DISKCACHE_CONFIG 64
 
+/* output formats, see emitter.c */
+#define EMIT_ICS 0
+#define EMIT_CSV 1
+#define EMIT_JSONL 2
+#define EMIT_BINARY 3
+#define EMIT_FORMATS 4
+#define MAX_EMITTERS 8   /* emitters chained in one pass */
+
+#define SHARED_READERS 128  /* threads that may read a shared cache at once */
+#define CACHELINE 64
+
+/*
+ * one day of the lunar calendar, packed in 8 bytes. jdn covers dates up to
+ * year 41,000, -1 in the signed fields means not set.
+ */
 struct lunarcal {
-    double jd;
-    int solarterm;    /* index of solarterm */
-    int lyear;        /* year in Lunar Calendar */
-    int month;        /* month in Lunar Calendar */
-    int day;          /* day in Lunar Calendar */
-    int holiday;      /* index of CN_HOLIDAY, -1 if not a traditional Holiday */
-    int is_lm;        /* leapmonth? */
+    unsigned int jdn : 24;    /* Julian Day Number, the date is JD jdn - 0.5 */
+    signed int solarterm : 6; /* index of solarterm */
+    unsigned int is_lm : 1;   /* leapmonth? */
+    signed int lyear : 16;    /* year in Lunar Calendar */
+    signed int month : 5;     /* month in Lunar Calendar */
+    signed int day : 6;       /* day in Lunar Calendar */
+    signed int holiday : 5;   /* index of CN_HOLIDAY, -1 if not a Holiday */
+};
+
+#define LCJD(lc) ((lc)->jdn - 0.5)   /* JD at midnight of a lunarcal */
+
+/* one month of a lunar calendar year */
+struct lunarmonth {
+    int start;           /* Julian Day Number of day 1 */
+    short lyear;         /* year in Lunar Calendar */
+    signed char month;   /* month in Lunar Calendar, 1 - 12 */
+    signed char is_lm;   /* leapmonth? */
+};
+
+/*
+ * the lunar calendar from month 11, day 1 of the previous year up to the day
+ * before the Winter Solstice of year, kept as the start of its months. Days
+ * are worked out from the month they fall in, none is stored.
+ */
+struct lunaryear {
+    int year;            /* Gregorian year of the closing Winter Solstice */
+    int nmonths;         /* months that start before end */
+    int leapmonth;       /* as returned by find_leap() */
+    int end;             /* JDN of the Winter Solstice, first day after it */
+    int newyear;         /* JDN of 正月初一 */
+    int events;          /* EV_ flags it was generated with */
+    struct lunarmonth months[MAX_LUNARMONTHS + 1];  /* one more for the start
+                                                       of the next month */
+    int solarterms[MAX_SOLARTERMS - 1];  /* JDN, from 小雪 of last year, 0
+                                            if not in events */
+};
+
+/*
+ * lunar calendar of years first to last packed into words, generated by
+ * gentable.
+ *
+ * years[i] is lunar year first + i:
+ *     bits  0 - 12  month lengths from 正月 on, set for 30 days
+ *     bits 13 - 16  the month the leap month follows, 0 if none
+ *     bits 17 - 22  days from January 1 to 正月初一
+ * terms[i] holds the 24 solar terms of Gregorian year first + i from 小寒 on,
+ * 2 bits each, in days after termbase[] counted as in a common year.
+ */
+struct lunartable {
+    int first;
+    int last;
+    const unsigned int *years;
+    const unsigned long long *terms;
+    const short *termbase;
+};
+
+extern const struct lunartable LUNARTABLE;
+
+/* a cached year, in the chain of its hash bucket and in the LRU list */
+struct yearnode {
+    struct lunaryear ly;
+    struct yearnode *hnext;  /* next in bucket */
+    struct yearnode *prev;   /* more recently used */
+    struct yearnode *next;   /* less recently used */
+};
+
+struct cachestats {
+    long hits;
+    long misses;
+    long waits;              /* misses another thread was computing */
+    long evictions;
+    int count;               /* years in cache */
+    int capacity;            /* max years in cache */
+};
+
+/* years of an engine by year number, the least recently used go first */
+struct yearcache {
+    struct yearnode **buckets;
+    int nbuckets;            /* power of 2, at least capacity */
+    struct yearnode *mru;
+    struct yearnode *lru;
+    struct cachestats stats;
+};
+
+/*
+ * The cache file starts with a header, followed by one entry for each year
+ * from first to last. Both are mapped and used in place.
+ */
+struct diskcache_header {
+    char magic[8];       /* DISKCACHE_MAGIC, not NUL terminated */
+    unsigned int version;    /* DISKCACHE_VERSION */
+    unsigned int byteorder;  /* 0x01020304 in the byte order of the writer */
+    unsigned int entrysize;  /* sizeof(struct diskcache_entry) */
+    int first;
+    int last;
+    char config[DISKCACHE_CONFIG];  /* solver_config() of the writer */
+    unsigned int checksum;   /* of all fields above */
+};
+
+struct diskcache_entry {
+    unsigned int checksum;   /* of year and ly, 0 while being written */
+    int year;
+    struct lunaryear ly;
+};
+
+/* a cache file opened by diskcache_open(), may be shared by engines */
+struct diskcache {
+    int fd;
+    size_t size;             /* bytes mapped */
+    void *map;
+    struct diskcache_entry *entries;
+    unsigned int seed;       /* header checksum, seeds entry checksums */
+    pthread_mutex_t lock;    /* between writers of this process */
 };
 
-struct lunarcal_cache {  /* the item in cache */
+/*
+ * All the state needed to compute lunar calendars. Engines share nothing,
+ * so independent years can be computed by separate engines concurrently.
+ */
+struct lcengine {
+    struct eventstream events;  /* new moons and solar terms in TZ_CN */
+    struct yearcache cache;
+    struct diskcache *disk;  /* shared cache file, NULL if not used */
+    int events_need;         /* EV_ flags of the years it generates */
+    int sparse;              /* solving only the events asked for */
+    char dtstamp[BUFSIZE];  /* DTSTAMP of every VEVENT printed */
+};
+
+/*
+ * a year in a shared cache. Once ready it is not changed until it is
+ * unlinked, and it is freed only after every reader that might see it is
+ * done with it.
+ */
+struct sharednode {
+    struct lunaryear ly;
     int year;
-    int len;             /* days count of this cached lunar calendar */
-    struct lunarcal *lcs[MAX_DAYS];   /* the cached lunar calendar */
+    int ready;               /* ly is complete */
+    int ref;                 /* read since the clock hand passed */
+    struct sharednode *next; /* next in bucket, NULL at the end */
+    struct sharednode *retired;  /* next waiting to be freed */
+    unsigned long epoch;     /* when it was unlinked */
+};
+
+/* a thread reading a shared cache, on a cache line of its own */
+struct cachereader {
+    unsigned long epoch;     /* epoch entered, 0 while outside */
+    int used;
+    struct sharedcache *cache;
+    struct lcengine *engine; /* computes the years missing */
+    long hits;
+    long misses;
+    long waits;              /* misses computed by another reader */
+} __attribute__((aligned(CACHELINE)));
+
+/*
+ * years shared by the engines of several threads. Readers take no lock,
+ * adding and evicting a year takes lock.
+ */
+struct sharedcache {
+    struct sharednode **buckets;
+    int nbuckets;            /* power of 2, at least capacity */
+    int capacity;
+    int count;
+    int hand;                /* bucket the clock hand is at */
+    long evictions;
+    unsigned long epoch;     /* global epoch, starts at 1 */
+    struct sharednode *retired;  /* unlinked but maybe still read */
+    pthread_mutex_t lock;    /* between writers */
+    pthread_cond_t done;     /* a year became ready */
+    struct cachereader readers[SHARED_READERS];
+};
+
+/*
+ * days of a calendar written in one format through one buffer, see
+ * emitter.c. Emitters chained by next are all written in the same pass.
+ */
+struct emitter {
+    int format;              /* EMIT_ */
+    int fd;                  /* written when the buffer is full, -1 to keep
+                                growing it in memory */
+    char *buf;
+    size_t len;
+    size_t size;
+    int error;               /* -1 once a write failed */
+    int jdn;                 /* JDN of ymd and iso, the day after the last */
+    char ymd[BUFSIZE];       /* YYYYMMDD */
+    char iso[BUFSIZE];       /* YYYY-MM-DD */
+    struct emitter *next;
+};
+
+/*
+ * a calendar of years start to end written to directory dir, one file for
+ * each year and format, with a manifest. See shard.c.
+ */
+struct shardset {
+    const char *dir;
+    int formats[EMIT_FORMATS];
+    int nformats;
+    int start;
+    int end;
+    int events;              /* EV_ flags of the engines */
+    time_t stamp;            /* DTSTAMP of the years computed */
+    struct diskcache *disk;  /* cache file shared by the workers, or NULL */
+    const struct prevcal *prev;  /* years to reuse, or NULL */
+    size_t *len;             /* bytes of year y in format i at */
+    unsigned long *crc;      /*   [(y - start) * nformats + i], and CRC-32 */
+    char (*dtstamp)[BUFSIZE];    /* of year y at [y - start] */
+    int inplace;             /* prev is in dir, its shards are kept */
+    int next_year;           /* next year to hand out to a worker */
+    int error;
+    pthread_mutex_t lock;
+};
+
+/* a year of a previous output, see prevcal.c */
+struct prevyear {
+    int format;              /* EMIT_ */
+    int year;
+    size_t offset;           /* in prevcal.data */
+    size_t len;
+    unsigned long crc;       /* CRC-32 of a shard in the manifest */
+    char dtstamp[BUFSIZE];   /* DTSTAMP the year was made with */
+};
+
+/* the years of a previous ICS file or directory of shards */
+struct prevcal {
+    char *dir;               /* directory of the shards, or NULL */
+    char *data;              /* the ICS file, or NULL */
+    int events;              /* EV_ flags it was made with */
+    int nyears;
+    int size;
+    struct prevyear *years;
 };
 
 /* Function prototypes */
-void cn_lunarcal(int year);
+struct lcengine *lcengine_alloc(void);
+
+void lcengine_free(struct lcengine *e);
+
+void set_dtstamp(struct lcengine *e, time_t t);
+
+void fmt_dtstamp(char *buf, time_t t);
+
+void set_events(struct lcengine *e, int events);
+
+int cn_lunarcal(struct lcengine *e, struct emitter *em, int year);
+
+void cn_lunarcal_range(struct lcengine *e, struct emitter *em, int first,
+                       int last);
 
-int get_cached_lc(struct lunarcal *lcs[], int len, int year);
+const struct lunaryear *get_lunaryear(struct lcengine *e, int year);
+
+void load_lunaryear(struct lcengine *e, struct lunaryear *ly, int year);
+
+int solar2lunar(struct lcengine *e, int year, int month, int day,
+                struct lunarcal *lc);
+
+int lunar2solar(struct lcengine *e, int lyear, int month, int day, int is_lm,
+                GregorianDate *g);
+
+int fast_solar2lunar(const struct lunartable *t, struct lcengine *e,
+                     int year, int month, int day, struct lunarcal *lc);
+
+int fast_lunar2solar(const struct lunartable *t, struct lcengine *e,
+                     int lyear, int month, int day, int is_lm,
+                     GregorianDate *g);
 
 double normjd(double jd, double tz);
 
-int find_leap(void);
+long winter_month(struct lcengine *e, int year);
+
+int find_leap(struct lcengine *e, int year, long k11);
 
-void update_solarterms_newmoons(int year);
+void gen_lunaryear(struct lcengine *e, struct lunaryear *ly, int year);
 
-int gen_lunar_calendar(struct lunarcal *lcs[], int len, int year);
+int gen_lunarspan(struct lcengine *e, struct lunaryear *ly, int year,
+                  int first, int last);
+
+int lunaryear_day(const struct lunaryear *ly, int events, int jdn,
+                  struct lunarcal *lc);
+
+int find_holiday(const struct lunarcal *lc, int qingming, int newyear);
 
 void ganzhi(char *buf, size_t buflen, int lyear);
 
-void mark_holiday(struct lunarcal *lcs[], int len);
+const char *solarterm_name(int solarterm);
+
+const char *holiday_name(int holiday);
+
+void lcinit(struct lunarcal *lc, double jd);
+
+size_t lunarday_summary(char *summary, const struct lunarcal *lc);
+
+int emit_open(struct emitter *em, int format, int fd);
+
+int emit_close(struct emitter *em);
+
+char *emit_detach(struct emitter *em, size_t *len);
+
+int emit_format(const char *name);
+
+const char *emit_name(int format);
+
+int emit_flush(struct emitter *em);
+
+int write_all(int fd, const char *buf, size_t len);
+
+void emit_write(struct emitter *em, const char *s, size_t len);
+
+void emit_begin(struct emitter *em, int start, int end, int events);
+
+void emit_day(struct emitter *em, struct lcengine *e,
+              const struct lunarcal *lc);
+
+void emit_end(struct emitter *em);
+
+unsigned long crc32_update(unsigned long crc, const char *buf, size_t len);
+
+int write_shards(struct shardset *ss, int jobs);
+
+int prevcal_open(struct prevcal *pc, const char *path, int events);
+
+void prevcal_close(struct prevcal *pc);
+
+const struct prevyear *prevcal_find(const struct prevcal *pc, int format,
+                                    int year);
+
+char *prevcal_year(const struct prevcal *pc, int format, int year,
+                   size_t *len);
+
+int prevcal_emit(const struct prevcal *pc, struct emitter *em, int year);
+
+struct diskcache *diskcache_open(const char *path);
+
+void diskcache_close(struct diskcache *dc);
+
+int diskcache_get(struct diskcache *dc, int year, struct lunaryear *ly);
+
+void diskcache_put(struct diskcache *dc, const struct lunaryear *ly);
+
+void use_diskcache(struct lcengine *e, struct diskcache *dc);
+
+int init_cache(struct lcengine *e);
+
+void free_cache(struct lcengine *e);
+
+int set_cachesize(struct lcengine *e, int capacity);
+
+int set_cachebudget(struct lcengine *e, size_t bytes);
+
+void get_cachestats(struct lcengine *e, struct cachestats *st);
+
+struct lunaryear *cache_find(struct lcengine *e, int year);
+
+struct lunaryear *cache_add(struct lcengine *e, int year);
+
+void evict_cache(struct lcengine *e);
+
+struct sharedcache *sharedcache_alloc(int capacity);
+
+void sharedcache_free(struct sharedcache *sc);
+
+void sharedcache_stats(struct sharedcache *sc, struct cachestats *st);
+
+struct cachereader *cachereader_join(struct sharedcache *sc,
+                                     struct lcengine *e);
 
-struct lunarcal *lcalloc(double jd);
+void cachereader_leave(struct cachereader *r);
 
-void print_lunarcal(struct lunarcal *lcs[], int len);
+void shared_enter(struct cachereader *r);
 
-int get_cache_index(int year);
+void shared_exit(struct cachereader *r);
 
-void init_cache(void);
+const struct lunaryear *shared_lunaryear(struct cachereader *r, int year);
 
-void add_cache(struct lunarcal *lcs[], int len);
+int shared_solar2lunar(struct cachereader *r, int year, int month, int day,
+                       struct lunarcal *lc);
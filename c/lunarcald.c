@@ -0,0 +1,572 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Lunar calendar daemon, answers conversions over a Unix socket.
+
+A lunarcal run for one date pays for starting the process, the ephemeris
+and the years it computes. lunarcald does that once and keeps its engine,
+the years cached and the packed table at hand, so a query costs a lookup.
+
+One thread serves every connection from an epoll loop. A request is a line
+of words, answered by a line starting with = on success or ! on error, in
+the order the requests came:
+
+    s YYYY MM DD         lunar date of a Gregorian date
+                         = LYEAR MONTH DAY LEAP TERM HOLIDAY SUMMARY
+    l LYEAR MONTH DAY LEAP
+                         Gregorian date of a lunar date, LEAP is 0 or 1
+                         = YYYY MM DD
+    n YYYY MM DD         first day on or after the date with a solar term
+                         or a holiday
+                         = YYYY MM DD TERM HOLIDAY
+    r YYYY-MM-DD YYYY-MM-DD [FORMAT]
+                         the days from the first date to the second, at
+                         most MAX_RANGE_DAYS, as lunarcal -f FORMAT writes
+                         them, ics by default
+                         = NBYTES, a newline and NBYTES of output
+    t                    requests served and the time they took
+                         = REQUESTS P50 P99, in microseconds
+
+TERM and HOLIDAY are names, - if there is none. The latency of a request
+is the time from reading its line to queueing its answer, the last
+LAT_SAMPLES of them are kept for the percentiles.
+
+s, l and n are answered from the packed table or the years cached, in
+microseconds. r formats every day and solves the lunar months of its span
+on the loop thread, which takes up to a few milliseconds for a year out of
+the table, every other client waits that long. Hence the short
+MAX_RANGE_DAYS, longer calendars are for lunarcal.
+
+A client may shut down its side after the last request, the answers
+queued are still sent before the connection is closed. The last request
+needs no newline then.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "astro.h"
+#include "lunarcalbase.h"
+
+#define DEFAULT_SOCKET "/tmp/lunarcald.sock"
+#define MAX_EVENTS 64        /* epoll events taken at a time */
+#define LINE_MAX_LEN 256     /* longest request */
+#define OUT_HIGH (1 << 20)   /* stop reading a client with this much unsent */
+#define MAX_RANGE_DAYS 366   /* longest r request */
+#define NEXT_DAYS 400        /* days searched by n */
+#define LAT_SAMPLES (1 << 16)
+
+struct conn {
+    int fd;
+    unsigned int mask;       /* epoll events asked for */
+    size_t inlen;
+    size_t sent;             /* bytes of out written to fd */
+    int eof;                 /* the client sends no more requests */
+    struct emitter out;      /* answers not yet sent */
+    char in[LINE_MAX_LEN];
+};
+
+static struct lcengine *engine;
+static int epfd;
+static volatile sig_atomic_t stop;
+static long requests;
+static long latency[LAT_SAMPLES];  /* ns, the last LAT_SAMPLES requests */
+
+void usage(void);
+void on_signal(int sig);
+long now_ns(void);
+int cmp_long(const void *a, const void *b);
+void percentiles(long *p50, long *p99);
+int valid_date(int year, int month, int day);
+void reply(struct conn *c, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void do_solar(struct conn *c, const char *args);
+void do_lunar(struct conn *c, const char *args);
+void do_next(struct conn *c, const char *args);
+void do_range(struct conn *c, const char *args);
+void handle(struct conn *c, char *line);
+void close_conn(struct conn *c);
+void watch(struct conn *c);
+int flush_conn(struct conn *c);
+int read_conn(struct conn *c);
+int listen_on(const char *path);
+
+
+void usage(void)
+{
+    printf("Usage: lunarcald [-c cachefile] [-s socket]\n"
+           "  -c  keep computed years in cachefile for later runs\n"
+           "  -s  listen on socket, %s by default\n", DEFAULT_SOCKET);
+    exit(2);
+}
+
+
+void on_signal(int sig)
+{
+    stop = 1;
+}
+
+
+long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* median and 99th percentile of the latencies kept, in ns */
+void percentiles(long *p50, long *p99)
+{
+    long n;
+    static long sorted[LAT_SAMPLES];
+
+    n = (requests < LAT_SAMPLES) ? requests : LAT_SAMPLES;
+    if (n == 0) {
+        *p50 = *p99 = 0;
+        return;
+    }
+
+    memcpy(sorted, latency, n * sizeof(long));
+    qsort(sorted, n, sizeof(long), cmp_long);
+    *p50 = sorted[n / 2];
+    *p99 = sorted[n * 99 / 100];
+}
+
+
+/* is year-month-day a day of the Gregorian calendar */
+int valid_date(int year, int month, int day)
+{
+    GregorianDate g;
+
+    if (month < 1 || month > 12 || day < 1 || day > 31)
+        return 0;
+    g = jd2g(g2jd(year, month, day));
+    return g.month == month && (int) g.day == day;
+}
+
+
+/* queue an answer line for c */
+void reply(struct conn *c, const char *fmt, ...)
+{
+    int n;
+    va_list ap;
+    char line[LINE_MAX_LEN * 2];
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    n = (n < (int) sizeof(line)) ? n : (int) sizeof(line) - 1;
+    emit_write(&c->out, line, n);
+}
+
+
+void do_solar(struct conn *c, const char *args)
+{
+    int year, month, day;
+    char summary[BUFSIZE * 4];
+    struct lunarcal lc;
+
+    if (sscanf(args, "%d %d %d", &year, &month, &day) != 3 ||
+        !valid_date(year, month, day) ||
+        fast_solar2lunar(&LUNARTABLE, engine, year, month, day, &lc) != 0) {
+        reply(c, "! bad date\n");
+        return;
+    }
+
+    lunarday_summary(summary, &lc);
+    reply(c, "= %d %d %d %d %s %s %s\n", lc.lyear, lc.month, lc.day,
+          lc.is_lm,
+          (lc.solarterm != -1) ? solarterm_name(lc.solarterm) : "-",
+          (lc.holiday != -1) ? holiday_name(lc.holiday) : "-", summary);
+}
+
+
+void do_lunar(struct conn *c, const char *args)
+{
+    int lyear, month, day, leap;
+    GregorianDate g;
+
+    if (sscanf(args, "%d %d %d %d", &lyear, &month, &day, &leap) != 4 ||
+        fast_lunar2solar(&LUNARTABLE, engine, lyear, month, day, leap != 0,
+                         &g) != 0) {
+        reply(c, "! no such lunar date\n");
+        return;
+    }
+
+    reply(c, "= %d %d %d\n", g.year, g.month, (int) g.day);
+}
+
+
+void do_next(struct conn *c, const char *args)
+{
+    int year, month, day, i;
+    double jd;
+    GregorianDate g;
+    struct lunarcal lc;
+
+    if (sscanf(args, "%d %d %d", &year, &month, &day) != 3 ||
+        !valid_date(year, month, day)) {
+        reply(c, "! bad date\n");
+        return;
+    }
+
+    jd = g2jd(year, month, day);
+    for (i = 0; i < NEXT_DAYS; i++) {
+        g = jd2g(jd + i);
+        if (fast_solar2lunar(&LUNARTABLE, engine, g.year, g.month,
+                             (int) g.day, &lc) != 0)
+            break;
+        if (lc.solarterm != -1 || lc.holiday != -1) {
+            reply(c, "= %d %d %d %s %s\n", g.year, g.month, (int) g.day,
+                  (lc.solarterm != -1) ? solarterm_name(lc.solarterm) : "-",
+                  (lc.holiday != -1) ? holiday_name(lc.holiday) : "-");
+            return;
+        }
+    }
+
+    reply(c, "! nothing found\n");
+}
+
+
+void do_range(struct conn *c, const char *args)
+{
+    int y1, m1, d1, y2, m2, d2, n, format, first, last;
+    size_t len;
+    char *buf, name[BUFSIZE];
+    struct emitter em;
+
+    strcpy(name, "ics");
+    n = sscanf(args, "%d-%d-%d %d-%d-%d %31s", &y1, &m1, &d1, &y2, &m2, &d2,
+               name);
+    if (n < 6 || !valid_date(y1, m1, d1) || !valid_date(y2, m2, d2)) {
+        reply(c, "! bad dates\n");
+        return;
+    }
+    if ((format = emit_format(name)) == -1) {
+        reply(c, "! unknown format\n");
+        return;
+    }
+
+    first = (int) (g2jd(y1, m1, d1) + 0.5);
+    last = (int) (g2jd(y2, m2, d2) + 0.5);
+    if (last < first || last - first >= MAX_RANGE_DAYS) {
+        reply(c, "! at most %d days\n", MAX_RANGE_DAYS);
+        return;
+    }
+
+    if (emit_open(&em, format, -1) != 0) {
+        reply(c, "! out of memory\n");
+        return;
+    }
+    set_dtstamp(engine, time(NULL));
+    emit_begin(&em, y1, y2, engine->events_need);
+    cn_lunarcal_range(engine, &em, first, last);
+    emit_end(&em);
+
+    buf = emit_detach(&em, &len);
+    reply(c, "= %zu\n", len);
+    emit_write(&c->out, buf, len);
+    free(buf);
+}
+
+
+/* answer the request in line, without its '\n' */
+void handle(struct conn *c, char *line)
+{
+    long t, p50, p99;
+
+    t = now_ns();
+    switch (line[0]) {
+    case 's':
+        do_solar(c, line + 1);
+        break;
+    case 'l':
+        do_lunar(c, line + 1);
+        break;
+    case 'n':
+        do_next(c, line + 1);
+        break;
+    case 'r':
+        do_range(c, line + 1);
+        break;
+    case 't':
+        percentiles(&p50, &p99);
+        reply(c, "= %ld %.1f %.1f\n", requests, p50 / 1e3, p99 / 1e3);
+        break;
+    default:
+        reply(c, "! unknown request\n");
+    }
+
+    latency[requests++ % LAT_SAMPLES] = now_ns() - t;
+}
+
+
+void close_conn(struct conn *c)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    emit_close(&c->out);
+    free(c);
+}
+
+
+/*
+ * ask epoll for what c waits on, input unless too much is unsent or the
+ * client sends no more
+ */
+void watch(struct conn *c)
+{
+    unsigned int mask;
+    struct epoll_event ev;
+
+    mask = (!c->eof && c->out.len - c->sent < OUT_HIGH) ? EPOLLIN : 0;
+    mask |= (c->sent < c->out.len) ? EPOLLOUT : 0;
+    if (mask == c->mask)
+        return;
+
+    c->mask = mask;
+    ev.events = mask;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+
+/*
+ * send what the socket takes of the answers
+ *
+ * Return: 0 on success, -1 if the client is gone
+ */
+int flush_conn(struct conn *c)
+{
+    ssize_t n;
+
+    while (c->sent < c->out.len) {
+        n = send(c->fd, c->out.buf + c->sent, c->out.len - c->sent,
+                 MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->sent += n;
+    }
+
+    c->out.len = 0;
+    c->sent = 0;
+    return 0;
+}
+
+
+/*
+ * read and answer the requests of c, c->eof is set once the client shuts
+ * down its side
+ *
+ * Return: 0 on success, -1 if the client is gone or sent a line too long
+ */
+int read_conn(struct conn *c)
+{
+    ssize_t n;
+    char *line, *nl;
+
+    for (;;) {
+        n = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+        if (n == 0) {
+            /* the last request may lack its '\n' */
+            if (c->inlen > 0) {
+                c->in[c->inlen] = '\0';
+                handle(c, c->in);
+                c->inlen = 0;
+            }
+            c->eof = 1;
+            return flush_conn(c);
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->inlen += n;
+
+        /* every complete line, the rest waits for more */
+        line = c->in;
+        while ((nl = memchr(line, '\n', c->in + c->inlen - line)) != NULL) {
+            *nl = '\0';
+            handle(c, line);
+            line = nl + 1;
+        }
+        c->inlen -= line - c->in;
+        memmove(c->in, line, c->inlen);
+        if (c->inlen == sizeof(c->in))
+            return -1;
+
+        if (flush_conn(c) != 0)
+            return -1;
+        if (c->out.len - c->sent >= OUT_HIGH)
+            return 0;
+    }
+}
+
+
+/* Return: listening socket at path, -1 on error */
+int listen_on(const char *path)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt, lfd, fd, i, n, year;
+    long p50, p99;
+    char *cachefile = NULL, *path = DEFAULT_SOCKET;
+    struct diskcache *disk = NULL;
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct sigaction sa;
+    struct conn *c;
+    GregorianDate today;
+
+    while ((opt = getopt(argc, argv, "c:s:")) != -1) {
+        switch (opt) {
+        case 'c':
+            cachefile = optarg;
+            break;
+        case 's':
+            path = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (cachefile && (disk = diskcache_open(cachefile)) == NULL)
+        perror(cachefile);
+
+    /* warm up, the ephemeris, its worker pool and the years around today */
+    engine = lcengine_alloc();
+    use_diskcache(engine, disk);
+    set_cachesize(engine, 256);
+    today = jd2g(time(NULL) / 86400.0 + 2440587.5);
+    for (year = today.year - 1; year <= today.year + 1; year++)
+        get_lunaryear(engine, year);
+
+    if ((lfd = listen_on(path)) == -1)
+        exit(1);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+    while (!stop) {
+        if ((n = epoll_wait(epfd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if ((c = (struct conn *) events[i].data.ptr) == NULL) {
+                while ((fd = accept(lfd, NULL, NULL)) != -1) {
+                    fcntl(fd, F_SETFL, O_NONBLOCK);
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    c = (struct conn *) calloc(1, sizeof(struct conn));
+                    if (c == NULL || emit_open(&c->out, EMIT_ICS, -1) != 0) {
+                        free(c);
+                        close(fd);
+                        continue;
+                    }
+                    c->fd = fd;
+                    c->mask = EPOLLIN;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+
+            /* after a hang up, send what is queued until send() fails */
+            if (events[i].events & EPOLLERR) {
+                close_conn(c);
+                continue;
+            }
+            if (events[i].events & EPOLLHUP)
+                c->eof = 1;
+            if ((events[i].events & (EPOLLOUT | EPOLLHUP)) &&
+                flush_conn(c) != 0) {
+                close_conn(c);
+                continue;
+            }
+            if ((events[i].events & EPOLLIN) && !c->eof &&
+                read_conn(c) != 0) {
+                close_conn(c);
+                continue;
+            }
+
+            /* all answered and nothing more to come */
+            if (c->eof && c->sent == c->out.len) {
+                close_conn(c);
+                continue;
+            }
+            watch(c);
+        }
+    }
+
+    percentiles(&p50, &p99);
+    fprintf(stderr, "%ld requests, p50 %.1f us, p99 %.1f us\n", requests,
+            p50 / 1e3, p99 / 1e3);
+    close(lfd);
+    unlink(path);
+    lcengine_free(engine);
+    diskcache_close(disk);
+    return 0;
+}
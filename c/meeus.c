@@ -0,0 +1,185 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Initial estimates of new moons and solar terms for the event solver.
+
+The mean phases of the Moon with their periodic corrections, and the low
+accuracy position of the Sun, both from Jean Meeus. They are good to a
+minute or so for new moons and to 0.01 degree for the Sun, close enough
+that Newton's method on the ephemeris series usually converges in one step.
+
+Reference:
+    Jean Meeus, Astronomical Algorithms, 2nd ed., chapter 25 and 49
+*/
+
+#include <stdio.h>
+#include <math.h>
+#include "astro.h"
+
+#define MEAN_LUNATION 29.530588861   /* mean synodic month in days */
+#define LUNATION0 2451550.09766      /* mean new moon of lunation 0 */
+
+/*
+ periodic corrections of the mean new moon, unit day
+ coefficient, power of E, multipliers of M, M', F, Omega
+*/
+static double NM_CORR[25][6] = {
+    { -0.40720, 0,  0,  1,  0, 0 },
+    {  0.17241, 1,  1,  0,  0, 0 },
+    {  0.01608, 0,  0,  2,  0, 0 },
+    {  0.01039, 0,  0,  0,  2, 0 },
+    {  0.00739, 1, -1,  1,  0, 0 },
+    { -0.00514, 1,  1,  1,  0, 0 },
+    {  0.00208, 2,  2,  0,  0, 0 },
+    { -0.00111, 0,  0,  1, -2, 0 },
+    { -0.00057, 0,  0,  1,  2, 0 },
+    {  0.00056, 1,  1,  2,  0, 0 },
+    { -0.00042, 0,  0,  3,  0, 0 },
+    {  0.00042, 1,  1,  0,  2, 0 },
+    {  0.00038, 1,  1,  0, -2, 0 },
+    { -0.00024, 1, -1,  2,  0, 0 },
+    { -0.00017, 0,  0,  0,  0, 1 },
+    { -0.00007, 0,  2,  1,  0, 0 },
+    {  0.00004, 0,  0,  2, -2, 0 },
+    {  0.00004, 0,  3,  0,  0, 0 },
+    {  0.00003, 0,  1,  1, -2, 0 },
+    {  0.00003, 0,  0,  2,  2, 0 },
+    { -0.00003, 0,  1,  1,  2, 0 },
+    {  0.00003, 0, -1,  1,  2, 0 },
+    { -0.00002, 0, -1,  1, -2, 0 },
+    { -0.00002, 0,  1,  3,  0, 0 },
+    {  0.00002, 0,  0,  4,  0, 0 },
+};
+
+/*
+ additional corrections by the planets, unit day
+ coefficient, argument in degrees at k = 0, per lunation, per T^2
+*/
+static double NM_PLANET[14][4] = {
+    { 0.000325, 299.77,  0.107408, -0.009173 },
+    { 0.000165, 251.88,  0.016321, 0 },
+    { 0.000164, 251.83, 26.651886, 0 },
+    { 0.000126, 349.42, 36.412478, 0 },
+    { 0.000110,  84.66, 18.206239, 0 },
+    { 0.000062, 141.74, 53.303771, 0 },
+    { 0.000060, 207.14,  2.453732, 0 },
+    { 0.000056, 154.84,  7.306860, 0 },
+    { 0.000047,  34.52, 27.261239, 0 },
+    { 0.000042, 207.19,  0.121824, 0 },
+    { 0.000040, 291.34,  1.844379, 0 },
+    { 0.000037, 161.72, 24.198154, 0 },
+    { 0.000035, 239.56, 25.513099, 0 },
+    { 0.000023, 331.55,  3.592518, 0 },
+};
+
+
+/* lunation number of the mean new moon nearest to jd, 0 is 2000-01-06 */
+double lunation(double jd)
+{
+    return floor((jd - LUNATION0) / MEAN_LUNATION + 0.5);
+}
+
+
+/*
+ * JDTT of the new moon of lunation k by the mean phase and its periodic
+ * corrections, within about a minute of the true new moon
+ */
+double meeus_newmoon(double k)
+{
+    int i;
+    double T, T2, jde, E, M, Mp, F, Om, arg;
+
+    T = k / 1236.85;
+    T2 = T * T;
+    jde = LUNATION0 + MEAN_LUNATION * k
+          + T2 * (0.00015437 + T * (-0.000000150 + T * 0.00000000073));
+
+    E = 1.0 - T * (0.002516 + T * 0.0000074);
+    M = (2.5534 + 29.10535670 * k - T2 * (0.0000014 + T * 0.00000011))
+        * DEG2RAD;
+    Mp = (201.5643 + 385.81693528 * k
+          + T2 * (0.0107582 + T * (0.00001238 - T * 0.000000058))) * DEG2RAD;
+    F = (160.7108 + 390.67050284 * k
+         - T2 * (0.0016118 + T * (0.00000227 - T * 0.000000011))) * DEG2RAD;
+    Om = (124.7746 - 1.56375588 * k + T2 * (0.0020672 + T * 0.00000215))
+         * DEG2RAD;
+
+    for (i = 0; i < 25; i++) {
+        arg = NM_CORR[i][2] * M + NM_CORR[i][3] * Mp + NM_CORR[i][4] * F
+              + NM_CORR[i][5] * Om;
+        jde += NM_CORR[i][0] * pow(E, NM_CORR[i][1]) * sin(arg);
+    }
+
+    for (i = 0; i < 14; i++) {
+        arg = NM_PLANET[i][1] + NM_PLANET[i][2] * k + NM_PLANET[i][3] * T2;
+        jde += NM_PLANET[i][0] * sin(arg * DEG2RAD);
+    }
+
+    return jde;
+}
+
+
+/*
+ * JDTT of the new moon nearest to jd. The true new moon may be half a day
+ * away from the mean one, so the nearest lunation is checked against the
+ * corrected time.
+ */
+double est_newmoon(double jd)
+{
+    double k, nm;
+
+    k = lunation(jd);
+    nm = meeus_newmoon(k);
+    if (jd - nm > MEAN_LUNATION / 2)
+        nm = meeus_newmoon(k + 1);
+    else if (nm - jd > MEAN_LUNATION / 2)
+        nm = meeus_newmoon(k - 1);
+    return nm;
+}
+
+
+/*
+ * apparent geocentric longitude of the Sun by the low accuracy method, good
+ * to 0.01 degree
+ *
+ * Arg:
+ *     jd: in JDTT
+ * Return:
+ *     longitude in degrees, not normalized
+ */
+double meeus_apparentsun(double jd)
+{
+    double T, L0, M, C, Om;
+
+    T = (jd - J2000) / 36525.0;
+    L0 = 280.46646 + T * (36000.76983 + T * 0.0003032);
+    M = (357.52911 + T * (35999.05029 - T * 0.0001537)) * DEG2RAD;
+    C = (1.914602 - T * (0.004817 + T * 0.000014)) * sin(M)
+        + (0.019993 - T * 0.000101) * sin(2 * M) + 0.000289 * sin(3 * M);
+    Om = (125.04 - 1934.136 * T) * DEG2RAD;
+
+    return L0 + C - 0.00569 - 0.00478 * sin(Om);
+}
+
+
+/*
+ * JDTT when the apparent Sun reaches angle degrees, counted from the Vernal
+ * Equinox of the year, negative angle searches backward from it. Within
+ * about a quarter of an hour of the true time.
+ */
+double est_solarterm(int year, double angle)
+{
+    int i;
+    double jd, d;
+
+    jd = g2jd(year, 3, 20.5) + angle * TROPICAL_YEAR / 360.0;
+    for (i = 0; i < 2; i++) {
+        d = fmod(angle - meeus_apparentsun(jd), 360.0);
+        if (d > 180)
+            d -= 360;
+        else if (d <= -180)
+            d += 360;
+        jd += d * TROPICAL_YEAR / 360.0;
+    }
+    return jd;
+}
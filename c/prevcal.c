@@ -0,0 +1,387 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Years of a previous output, reused when a rolling calendar is updated.
+
+A calendar of the previous, this and the next year published every day
+changes one year a year. An update with lunarcal -u takes the years it
+still covers from the previous output, byte for byte, and computes only the
+year that enters.
+
+The previous output is either an ICS file or a directory of shards with a
+manifest, see shard.c. An ICS file is read whole and cut at the years of
+DTSTART, a year is taken only if it has all its days. A shard is read when
+asked for and checked against the length and CRC-32 in the manifest.
+Neither is used unless lunarcal made it with the events asked for.
+
+A reused year keeps the DTSTAMP it was made with. Its events are the same
+as they were then, so the stamp is still right and calendar clients see
+nothing new in them, only the year that entered is stamped by this run.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "astro.h"
+#include "lunarcalbase.h"
+
+#define ICS_BEGIN "BEGIN:VEVENT\n"
+#define ICS_DTSTART "DTSTART;VALUE=DATE:"
+#define ICS_DTSTAMP "DTSTAMP:"
+#define ICS_END "END:VEVENT\n"
+
+
+/* add a year, the fields after year are left to the caller */
+static struct prevyear *add_year(struct prevcal *pc, int format, int year)
+{
+    int size;
+    struct prevyear *years, *py;
+
+    if (pc->nyears == pc->size) {
+        size = pc->size ? 2 * pc->size : 16;
+        years = (struct prevyear *) realloc(pc->years,
+                                            size * sizeof(struct prevyear));
+        if (years == NULL)
+            return NULL;
+        pc->years = years;
+        pc->size = size;
+    }
+
+    py = &pc->years[pc->nyears++];
+    memset(py, 0, sizeof(struct prevyear));
+    py->format = format;
+    py->year = year;
+    return py;
+}
+
+
+/* the whole of file path, NUL terminated, NULL on error */
+static char *read_file(const char *path, size_t *size)
+{
+    int fd;
+    char *buf;
+    struct stat st;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return NULL;
+
+    buf = NULL;
+    if (fstat(fd, &st) == 0 && (buf = (char *) malloc(st.st_size + 1))) {
+        if (read(fd, buf, st.st_size) == st.st_size) {
+            buf[st.st_size] = '\0';
+            *size = st.st_size;
+        } else {
+            free(buf);
+            buf = NULL;
+        }
+    }
+
+    close(fd);
+    return buf;
+}
+
+
+/* the line at p, which ends by '\n', into buf of size */
+static void copy_line(char *buf, size_t size, const char *p)
+{
+    size_t n;
+
+    n = strcspn(p, "\n");
+    n = (n < size - 1) ? n : size - 1;
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+}
+
+
+/*
+ * EV_ flags of an ICS by its header, which must be the same as lunarcal
+ * writes. Other calendars may name the days differently.
+ *
+ * Return: -1 if the header is not of lunarcal
+ */
+static int ics_events(const char *data)
+{
+    int i, start, end, events;
+    size_t len, hlen;
+    char *p, *head, line[BUFSIZE * 4];
+    struct emitter em;
+    static const int EVENTS[] = {EV_ALL, EV_HOLIDAYS};
+
+    if ((p = strstr(data, "\nX-WR-CALDESC:")) == NULL)
+        return -1;
+    copy_line(line, sizeof(line), p + 1);
+    if (sscanf(line, "X-WR-CALDESC:中国农历%d-%d", &start, &end) != 2)
+        return -1;
+    if ((p = strstr(data, ICS_BEGIN)) == NULL)
+        return -1;
+    len = p - data;
+
+    events = -1;
+    for (i = 0; i < 2 && events == -1; i++) {
+        if (emit_open(&em, EMIT_ICS, -1) != 0)
+            return -1;
+        emit_begin(&em, start, end, EVENTS[i]);
+        head = emit_detach(&em, &hlen);
+        if (hlen == len && memcmp(data, head, len) == 0)
+            events = EVENTS[i];
+        free(head);
+    }
+
+    return events;
+}
+
+
+/* close the year of VEVENTs from offset start to end if it has every day */
+static void ics_year(struct prevcal *pc, int year, size_t start, size_t end,
+                     int days, int last, const char *dtstamp)
+{
+    struct prevyear *py;
+
+    if (year == INT_MIN)
+        return;
+    if (days != (int) (g2jd(year + 1, 1, 1.0) - g2jd(year, 1, 1.0) + 0.5) ||
+        last != 1231)
+        return;
+
+    if ((py = add_year(pc, EMIT_ICS, year)) != NULL) {
+        py->offset = start;
+        py->len = end - start;
+        snprintf(py->dtstamp, BUFSIZE, "%s", dtstamp);
+    }
+}
+
+
+/* cut the ICS in pc->data at its years */
+static void ics_years(struct prevcal *pc)
+{
+    int y, m, d, year, days, last;
+    size_t start;
+    char *p, *next, *s, line[BUFSIZE], dtstamp[BUFSIZE];
+
+    year = INT_MIN;
+    days = last = 0;
+    start = 0;
+    dtstamp[0] = '\0';
+    for (p = strstr(pc->data, ICS_BEGIN); p; p = next) {
+        next = strstr(p + 1, ICS_BEGIN);
+        s = strstr(p, ICS_DTSTART);
+        if (s == NULL || (next && s > next))
+            break;
+
+        /* sscanf() would run strlen() over the rest of the file */
+        copy_line(line, sizeof(line), s + strlen(ICS_DTSTART));
+        if (sscanf(line, "%4d%2d%2d", &y, &m, &d) != 3)
+            break;
+
+        if (y != year) {
+            ics_year(pc, year, start, p - pc->data, days, last, dtstamp);
+            year = y;
+            start = p - pc->data;
+            days = 0;
+            last = 0;
+
+            /* a year must start on January 1 */
+            if (m != 1 || d != 1)
+                year = INT_MIN;
+
+            dtstamp[0] = '\0';
+            if ((s = strstr(p, ICS_DTSTAMP)) != NULL && (!next || s < next))
+                copy_line(dtstamp, BUFSIZE, s + strlen(ICS_DTSTAMP));
+        }
+
+        days++;
+        last = m * 100 + d;
+        if (next == NULL) {
+            /* the last VEVENT ends before END:VCALENDAR */
+            if ((s = strstr(p, ICS_END)) != NULL)
+                ics_year(pc, year, start, s + strlen(ICS_END) - pc->data, days,
+                         last, dtstamp);
+        }
+    }
+}
+
+
+/* the years of the shards in the manifest of pc->dir */
+static int manifest_years(struct prevcal *pc)
+{
+    int version, year, format, n, events;
+    long stamp;
+    size_t offset, len;
+    unsigned long crc;
+    char line[PATH_MAX], path[PATH_MAX], fmt[BUFSIZE], name[BUFSIZE];
+    char ext[BUFSIZE], dtstamp[BUFSIZE];
+    struct prevyear *py;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/manifest", pc->dir);
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+
+    events = -1;
+    dtstamp[0] = '\0';
+    if (fgets(line, sizeof(line), fp) == NULL ||
+        sscanf(line, "LUNARCAL-MANIFEST %d", &version) != 1 || version > 2) {
+        fclose(fp);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "events %d", &events) == 1)
+            continue;
+        if (sscanf(line, "stamp %ld", &stamp) == 1) {
+            fmt_dtstamp(dtstamp, (time_t) stamp);
+            continue;
+        }
+
+        n = sscanf(line, "%31s %31s %zu %zu %lx %31s", fmt, name, &offset,
+                   &len, &crc, dtstamp);
+        if (n < 5 || sscanf(name, "%d.%31s", &year, ext) != 2 ||
+            strcmp(ext, fmt) != 0 || (format = emit_format(fmt)) == -1)
+            continue;
+
+        if ((py = add_year(pc, format, year)) == NULL)
+            break;
+        py->len = len;
+        py->crc = crc;
+        snprintf(py->dtstamp, BUFSIZE, "%s", dtstamp);
+    }
+
+    fclose(fp);
+    pc->events = events;
+    return 0;
+}
+
+
+/*
+ * the years in path, a previous ICS file or a directory of shards. Years are
+ * reused only if path was made with events, EV_ flags.
+ *
+ * Return: 0 on success, -1 if path is not a previous output
+ */
+int prevcal_open(struct prevcal *pc, const char *path, int events)
+{
+    size_t size;
+    struct stat st;
+
+    memset(pc, 0, sizeof(struct prevcal));
+    if (stat(path, &st) != 0)
+        return -1;
+
+    if (S_ISDIR(st.st_mode)) {
+        pc->dir = strdup(path);
+        if (pc->dir == NULL || manifest_years(pc) != 0) {
+            prevcal_close(pc);
+            return -1;
+        }
+    } else {
+        pc->data = read_file(path, &size);
+        if (pc->data == NULL ||
+            strncmp(pc->data, "BEGIN:VCALENDAR\n", 16) != 0) {
+            prevcal_close(pc);
+            return -1;
+        }
+        pc->events = ics_events(pc->data);
+        ics_years(pc);
+    }
+
+    if (pc->events != events) {
+        fprintf(stderr, "%s: not made by lunarcal with the same events, "
+                "computing every year\n", path);
+        pc->nyears = 0;
+    }
+    return 0;
+}
+
+
+void prevcal_close(struct prevcal *pc)
+{
+    free(pc->dir);
+    free(pc->data);
+    free(pc->years);
+    memset(pc, 0, sizeof(struct prevcal));
+}
+
+
+/* the year in format, NULL if not in pc */
+const struct prevyear *prevcal_find(const struct prevcal *pc, int format,
+                                    int year)
+{
+    int i;
+
+    for (i = 0; i < pc->nyears; i++)
+        if (pc->years[i].year == year && pc->years[i].format == format)
+            return &pc->years[i];
+    return NULL;
+}
+
+
+/*
+ * the bytes of year in format as they were output, the caller frees them.
+ * A shard must still match the manifest.
+ *
+ * Return: NULL if year is not in pc in format
+ */
+char *prevcal_year(const struct prevcal *pc, int format, int year,
+                   size_t *len)
+{
+    size_t size;
+    char *buf, path[PATH_MAX];
+    const struct prevyear *py;
+
+    if ((py = prevcal_find(pc, format, year)) == NULL)
+        return NULL;
+
+    if (pc->data) {
+        if ((buf = (char *) malloc(py->len ? py->len : 1)) == NULL)
+            return NULL;
+        memcpy(buf, pc->data + py->offset, py->len);
+        *len = py->len;
+        return buf;
+    }
+
+    snprintf(path, sizeof(path), "%s/%d.%s", pc->dir, year,
+             emit_name(format));
+    if ((buf = read_file(path, &size)) == NULL)
+        return NULL;
+    if (size != py->len || crc32_update(0, buf, size) != py->crc) {
+        fprintf(stderr, "%s: changed since the manifest, computing it\n",
+                path);
+        free(buf);
+        return NULL;
+    }
+
+    *len = size;
+    return buf;
+}
+
+
+/*
+ * write year from pc to every emitter chained from em, only if pc has it in
+ * all their formats
+ *
+ * Return: 0 if written, -1 if the year is to be computed
+ */
+int prevcal_emit(const struct prevcal *pc, struct emitter *em, int year)
+{
+    int i, n;
+    size_t len[MAX_EMITTERS];
+    char *buf[MAX_EMITTERS];
+    struct emitter *w;
+
+    for (n = 0, w = em; w; n++, w = w->next)
+        if (n == MAX_EMITTERS ||
+            (buf[n] = prevcal_year(pc, w->format, year, &len[n])) == NULL)
+            break;
+
+    if (w == NULL)
+        for (i = 0, w = em; w; i++, w = w->next)
+            emit_write(w, buf[i], len[i]);
+
+    for (i = 0; i < n; i++)
+        free(buf[i]);
+    return w ? -1 : 0;
+}
@@ -0,0 +1,459 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Calendars written to a directory in shards, one file for each year.
+
+Workers take a few consecutive years at a time and write each year in each
+format to its own file, YEAR.FORMAT, e.g. 2016.ics. What comes before and
+after the days, the ICS header for instance, goes to head.FORMAT and
+tail.FORMAT. The whole calendar is then head, the years in order and tail
+put together, the shards hold no header of their own.
+
+A year is formatted in memory and written by a single write(), the data of
+all files is synced once at the end. Last the manifest is written, listing
+for every format its files in order, with the offset each starts at in the
+whole calendar, its length, CRC-32 and the DTSTAMP it was made with:
+
+    LUNARCAL-MANIFEST 2
+    years 2015 2017
+    events 3
+    ics head.ics 0 243 5d1c0a3e 20201017T120000Z
+    ics 2015.ics 243 73198 9a0b5c21 20201016T120000Z
+    ...
+
+Years of a previous output, see prevcal.c, are taken as they are instead of
+computed. Shards already in the directory are left alone, and the shards of
+years no longer covered are removed after the new manifest.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "astro.h"
+#include "lunarcalbase.h"
+
+#define SHARD_YEARS 4       /* consecutive years a worker takes at a time */
+#define SHARD_MAX_JOBS 64
+#define MANIFEST "manifest"
+#define MANIFEST_VERSION 2
+
+static unsigned long CRC_TABLE[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+
+static void init_crc(void)
+{
+    int i, k;
+    unsigned long c;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+        CRC_TABLE[i] = c;
+    }
+}
+
+
+/* CRC-32 of buf appended to crc, which is 0 to start, as zlib crc32() */
+unsigned long crc32_update(unsigned long crc, const char *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) buf;
+
+    pthread_once(&crc_once, init_crc);
+    crc ^= 0xffffffffUL;
+    while (len--)
+        crc = CRC_TABLE[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffUL;
+}
+
+
+/*
+ * replace file name in dir by len bytes at buf
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int write_file(const char *dir, const char *name, const char *buf,
+                      size_t len)
+{
+    int fd, ret;
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        perror(path);
+        return -1;
+    }
+
+    ret = write_all(fd, buf, len);
+    if (close(fd) != 0 || ret != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* fdatasync file name in dir, or the directory itself if name is NULL */
+static int sync_file(const char *dir, const char *name)
+{
+    int fd, ret;
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name ? name : ".");
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        perror(path);
+        return -1;
+    }
+
+    ret = name ? fdatasync(fd) : fsync(fd);
+    close(fd);
+    if (ret != 0)
+        perror(path);
+    return ret;
+}
+
+
+/*
+ * take year in every format of ss from ss->prev into bufs and lens
+ *
+ * Return: 0 on success, -1 if the year is to be computed
+ */
+static int reuse_year(struct shardset *ss, int year, char **bufs,
+                      size_t *lens)
+{
+    int i;
+    const struct prevyear *py;
+
+    for (i = 0; i < ss->nformats; i++)
+        if ((bufs[i] = prevcal_year(ss->prev, ss->formats[i], year,
+                                    &lens[i])) == NULL)
+            break;
+
+    if (i < ss->nformats) {
+        while (i--)
+            free(bufs[i]);
+        return -1;
+    }
+
+    py = prevcal_find(ss->prev, ss->formats[0], year);
+    snprintf(ss->dtstamp[year - ss->start], BUFSIZE, "%s", py->dtstamp);
+    return 0;
+}
+
+
+/* write year in every format of ss by engine e, or as it was in ss->prev */
+static int write_year(struct shardset *ss, struct lcengine *e, int year)
+{
+    int i, ret, k, reused;
+    size_t lens[EMIT_FORMATS];
+    char *bufs[EMIT_FORMATS], name[BUFSIZE];
+    struct emitter w[EMIT_FORMATS];
+
+    reused = ss->prev && reuse_year(ss, year, bufs, lens) == 0;
+    for (i = 0; !reused && i < ss->nformats; i++) {
+        if (emit_open(&w[i], ss->formats[i], -1) != 0) {
+            while (i-- > 0)
+                emit_close(&w[i]);
+            return -1;
+        }
+        if (i > 0)
+            w[i - 1].next = &w[i];
+    }
+
+    ret = 0;
+    if (!reused) {
+        if (cn_lunarcal(e, w, year) != 0)
+            ret = -1;
+        strcpy(ss->dtstamp[year - ss->start], e->dtstamp);
+        for (i = 0; i < ss->nformats; i++) {
+            if (w[i].error)
+                ret = -1;
+            bufs[i] = emit_detach(&w[i], &lens[i]);
+        }
+    }
+
+    k = (year - ss->start) * ss->nformats;
+    for (i = 0; i < ss->nformats; i++) {
+        ss->len[k + i] = lens[i];
+        ss->crc[k + i] = crc32_update(0, bufs[i], lens[i]);
+        snprintf(name, sizeof(name), "%d.%s", year, emit_name(ss->formats[i]));
+
+        /* a shard reused in place is already there */
+        if (ret == 0 && !(reused && ss->inplace) &&
+            write_file(ss->dir, name, bufs[i], lens[i]) != 0)
+            ret = -1;
+        free(bufs[i]);
+    }
+
+    return ret;
+}
+
+
+static void *shard_worker(void *args)
+{
+    int year, last;
+    struct shardset *ss = (struct shardset *) args;
+    struct lcengine *e;
+
+    if ((e = lcengine_alloc()) == NULL) {
+        fprintf(stderr, "%s: out of memory\n", ss->dir);
+        pthread_mutex_lock(&ss->lock);
+        ss->error = -1;
+        pthread_mutex_unlock(&ss->lock);
+        return NULL;
+    }
+
+    set_dtstamp(e, ss->stamp);
+    use_diskcache(e, ss->disk);
+    set_events(e, ss->events);
+    for (;;) {
+        pthread_mutex_lock(&ss->lock);
+        year = ss->next_year;
+        ss->next_year += SHARD_YEARS;
+        pthread_mutex_unlock(&ss->lock);
+        if (year > ss->end)
+            break;
+
+        last = year + SHARD_YEARS - 1;
+        last = (last > ss->end) ? ss->end : last;
+        for (; year <= last; year++)
+            if (write_year(ss, e, year) != 0) {
+                pthread_mutex_lock(&ss->lock);
+                ss->error = -1;
+                pthread_mutex_unlock(&ss->lock);
+            }
+    }
+
+    lcengine_free(e);
+    return NULL;
+}
+
+
+/*
+ * head and tail of format i into ss->len and ss->crc after the years,
+ * head.FORMAT and tail.FORMAT
+ */
+static int write_ends(struct shardset *ss, int i)
+{
+    int k, ret;
+    size_t len;
+    char *buf, name[BUFSIZE];
+    struct emitter w;
+
+    /* after the years, k is head and k + nformats tail */
+    k = (ss->end - ss->start + 1) * ss->nformats + i;
+    ret = 0;
+    if (emit_open(&w, ss->formats[i], -1) != 0)
+        return -1;
+    emit_begin(&w, ss->start, ss->end, ss->events);
+    buf = emit_detach(&w, &len);
+    ss->len[k] = len;
+    ss->crc[k] = crc32_update(0, buf, len);
+    snprintf(name, sizeof(name), "head.%s", emit_name(ss->formats[i]));
+    ret |= write_file(ss->dir, name, buf, len);
+    free(buf);
+
+    k += ss->nformats;
+    if (emit_open(&w, ss->formats[i], -1) != 0)
+        return -1;
+    emit_end(&w);
+    buf = emit_detach(&w, &len);
+    ss->len[k] = len;
+    ss->crc[k] = crc32_update(0, buf, len);
+    snprintf(name, sizeof(name), "tail.%s", emit_name(ss->formats[i]));
+    ret |= write_file(ss->dir, name, buf, len);
+    free(buf);
+
+    return ret;
+}
+
+
+/* sync the data of every file of ss, then the directory */
+static int sync_shards(struct shardset *ss)
+{
+    int i, year, ret;
+    const char *fmt;
+    char name[BUFSIZE];
+
+    ret = 0;
+    for (i = 0; i < ss->nformats; i++) {
+        fmt = emit_name(ss->formats[i]);
+        snprintf(name, sizeof(name), "head.%s", fmt);
+        ret |= sync_file(ss->dir, name);
+        for (year = ss->start; year <= ss->end; year++) {
+            snprintf(name, sizeof(name), "%d.%s", year, fmt);
+            ret |= sync_file(ss->dir, name);
+        }
+        snprintf(name, sizeof(name), "tail.%s", fmt);
+        ret |= sync_file(ss->dir, name);
+    }
+
+    return ret | sync_file(ss->dir, NULL);
+}
+
+
+/* one manifest line, offset is advanced past the file */
+static void manifest_line(FILE *fp, const char *fmt, const char *name,
+                          size_t *offset, size_t len, unsigned long crc,
+                          const char *dtstamp)
+{
+    fprintf(fp, "%s %s %zu %zu %08lx %s\n", fmt, name, *offset, len, crc,
+            dtstamp);
+    *offset += len;
+}
+
+
+/* write the manifest as a new file, renamed over the old one once synced */
+static int write_manifest(struct shardset *ss)
+{
+    int i, k, year, nyears, ret;
+    size_t offset;
+    const char *fmt;
+    char name[BUFSIZE], path[PATH_MAX], tmp[PATH_MAX], dtstamp[BUFSIZE];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", ss->dir, MANIFEST);
+    snprintf(tmp, sizeof(tmp), "%s/%s.tmp", ss->dir, MANIFEST);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        perror(tmp);
+        return -1;
+    }
+
+    fprintf(fp, "LUNARCAL-MANIFEST %d\n", MANIFEST_VERSION);
+    fprintf(fp, "years %d %d\n", ss->start, ss->end);
+    fprintf(fp, "events %d\n", ss->events);
+    fmt_dtstamp(dtstamp, ss->stamp);
+
+    nyears = ss->end - ss->start + 1;
+    for (i = 0; i < ss->nformats; i++) {
+        fmt = emit_name(ss->formats[i]);
+        offset = 0;
+        k = nyears * ss->nformats + i;
+        snprintf(name, sizeof(name), "head.%s", fmt);
+        manifest_line(fp, fmt, name, &offset, ss->len[k], ss->crc[k],
+                      dtstamp);
+        for (year = ss->start; year <= ss->end; year++) {
+            k = (year - ss->start) * ss->nformats + i;
+            snprintf(name, sizeof(name), "%d.%s", year, fmt);
+            manifest_line(fp, fmt, name, &offset, ss->len[k], ss->crc[k],
+                          ss->dtstamp[year - ss->start]);
+        }
+        k = (nyears + 1) * ss->nformats + i;
+        snprintf(name, sizeof(name), "tail.%s", fmt);
+        manifest_line(fp, fmt, name, &offset, ss->len[k], ss->crc[k],
+                      dtstamp);
+    }
+
+    ret = (fflush(fp) != 0 || fdatasync(fileno(fp)) != 0) ? -1 : 0;
+    if (fclose(fp) != 0 || ret != 0 || rename(tmp, path) != 0) {
+        perror(path);
+        return -1;
+    }
+
+    return sync_file(ss->dir, NULL);
+}
+
+
+/* remove the shards of ss->prev in ss->dir the manifest no longer lists */
+static void remove_dropped(struct shardset *ss)
+{
+    int i, k;
+    char path[PATH_MAX];
+    const struct prevyear *py;
+
+    for (i = 0; i < ss->prev->nyears; i++) {
+        py = &ss->prev->years[i];
+        for (k = 0; k < ss->nformats && ss->formats[k] != py->format; k++)
+            ;
+        if (k < ss->nformats && py->year >= ss->start && py->year <= ss->end)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%d.%s", ss->dir, py->year,
+                 emit_name(py->format));
+        unlink(path);
+    }
+}
+
+
+/* is ss->prev a directory of shards, and the same as ss->dir */
+static int same_dir(struct shardset *ss)
+{
+    struct stat a, b;
+
+    if (ss->prev == NULL || ss->prev->dir == NULL)
+        return 0;
+    if (stat(ss->dir, &a) != 0 || stat(ss->prev->dir, &b) != 0)
+        return 0;
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+
+/*
+ * write the calendar of ss to ss->dir on jobs threads, the directory is
+ * created if missing. The caller sets dir to prev.
+ *
+ * Return: 0 on success, -1 on error, which has been reported
+ */
+int write_shards(struct shardset *ss, int jobs)
+{
+    int i, n;
+    pthread_t threads[SHARD_MAX_JOBS];
+
+    if (mkdir(ss->dir, 0755) != 0 && errno != EEXIST) {
+        perror(ss->dir);
+        return -1;
+    }
+
+    /* the years, then heads, then tails */
+    n = (ss->end - ss->start + 3) * ss->nformats;
+    ss->len = (size_t *) calloc(n, sizeof(size_t));
+    ss->crc = (unsigned long *) calloc(n, sizeof(unsigned long));
+    ss->dtstamp = (char (*)[BUFSIZE]) calloc(ss->end - ss->start + 1,
+                                             BUFSIZE);
+    if (ss->len == NULL || ss->crc == NULL || ss->dtstamp == NULL) {
+        fprintf(stderr, "%s: out of memory\n", ss->dir);
+        free(ss->len);
+        free(ss->crc);
+        free(ss->dtstamp);
+        return -1;
+    }
+
+    ss->inplace = same_dir(ss);
+    ss->next_year = ss->start;
+    ss->error = 0;
+    pthread_mutex_init(&ss->lock, NULL);
+
+    jobs = (jobs > SHARD_MAX_JOBS) ? SHARD_MAX_JOBS : jobs;
+    for (i = 0; i < jobs; i++)
+        pthread_create(&threads[i], NULL, shard_worker, ss);
+    for (i = 0; i < ss->nformats; i++)
+        if (write_ends(ss, i) != 0) {
+            pthread_mutex_lock(&ss->lock);
+            ss->error = -1;
+            pthread_mutex_unlock(&ss->lock);
+        }
+    for (i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+
+    if (ss->error == 0 && sync_shards(ss) == 0)
+        ss->error = write_manifest(ss);
+    else
+        ss->error = -1;
+    if (ss->error == 0 && ss->inplace)
+        remove_dropped(ss);
+
+    pthread_mutex_destroy(&ss->lock);
+    free(ss->len);
+    free(ss->crc);
+    free(ss->dtstamp);
+    ss->len = NULL;
+    ss->crc = NULL;
+    ss->dtstamp = NULL;
+    return ss->error;
+}
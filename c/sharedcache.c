@@ -0,0 +1,337 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Cache of lunar years shared by the engines of many threads.
+
+Nearly every lookup finds a year that is already computed, and a computed
+year never changes, so readers take no lock at all. They walk the hash
+chains by atomic loads and only mark the year as recently read.
+
+A thread adding or evicting a year holds the cache lock. A year missing is
+added as a node not yet ready before it is computed, so another thread
+asking for the same year finds the node and waits for it instead of
+computing the year again. Years are evicted by the clock algorithm, the
+hand skips a year read since it last passed.
+
+An evicted year is unlinked at once but freed later, by epochs. A reader
+records the global epoch when it enters, an evicted year records it when
+unlinked and the global epoch is advanced. The year is freed once every
+reader inside entered after that.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "astro.h"
+#include "lunarcalbase.h"
+
+
+static struct sharednode **shared_bucket(struct sharedcache *sc, int year)
+{
+    return &sc->buckets[(unsigned int) year & (sc->nbuckets - 1)];
+}
+
+
+static struct sharednode *lookup(struct sharedcache *sc, int year)
+{
+    struct sharednode *node;
+
+    node = __atomic_load_n(shared_bucket(sc, year), __ATOMIC_ACQUIRE);
+    while (node && node->year != year)
+        node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    return node;
+}
+
+
+/* free the evicted years no reader can see any more, sc->lock held */
+static void reclaim(struct sharedcache *sc)
+{
+    int i;
+    unsigned long epoch, oldest;
+    struct sharednode *node, **p;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    oldest = ULONG_MAX;
+    for (i = 0; i < SHARED_READERS; i++) {
+        epoch = __atomic_load_n(&sc->readers[i].epoch, __ATOMIC_ACQUIRE);
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+
+    p = &sc->retired;
+    while ((node = *p) != NULL) {
+        if (node->epoch < oldest) {
+            *p = node->retired;
+            free(node);
+        } else {
+            p = &node->retired;
+        }
+    }
+}
+
+
+/*
+ * unlink a ready year not read since the hand last passed, sc->lock held
+ *
+ * Return: 0 if every year is being computed
+ */
+static int evict(struct sharedcache *sc)
+{
+    int n;
+    struct sharednode *node, **p;
+
+    for (n = 0; n <= 2 * sc->nbuckets; n++) {
+        p = &sc->buckets[sc->hand];
+        for (node = *p; node; p = &node->next, node = *p) {
+            if (!node->ready)
+                continue;
+            if (__atomic_load_n(&node->ref, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&node->ref, 0, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            /* readers at node still go on by node->next */
+            __atomic_store_n(p, node->next, __ATOMIC_RELEASE);
+            node->epoch = __atomic_load_n(&sc->epoch, __ATOMIC_SEQ_CST);
+            node->retired = sc->retired;
+            sc->retired = node;
+            sc->count--;
+            sc->evictions++;
+            return 1;
+        }
+        sc->hand = (sc->hand + 1) & (sc->nbuckets - 1);
+    }
+
+    return 0;
+}
+
+
+/*
+ * empty cache of capacity years, at least CACHE_MIN
+ *
+ * Return: NULL if out of memory
+ */
+struct sharedcache *sharedcache_alloc(int capacity)
+{
+    int n;
+    struct sharedcache *sc;
+
+    capacity = (capacity < CACHE_MIN) ? CACHE_MIN : capacity;
+    for (n = 1; n < capacity; n *= 2)
+        ;
+
+    if (posix_memalign((void **) &sc, CACHELINE, sizeof(struct sharedcache)))
+        return NULL;
+    memset(sc, 0, sizeof(struct sharedcache));
+
+    sc->buckets = (struct sharednode **) calloc(n, sizeof(struct sharednode *));
+    if (sc->buckets == NULL) {
+        free(sc);
+        return NULL;
+    }
+
+    sc->nbuckets = n;
+    sc->capacity = capacity;
+    sc->epoch = 1;
+    pthread_mutex_init(&sc->lock, NULL);
+    pthread_cond_init(&sc->done, NULL);
+    return sc;
+}
+
+
+/* free sc and its years, no thread may be reading it */
+void sharedcache_free(struct sharedcache *sc)
+{
+    int i;
+    struct sharednode *node;
+
+    for (i = 0; i < sc->nbuckets; i++)
+        while ((node = sc->buckets[i]) != NULL) {
+            sc->buckets[i] = node->next;
+            free(node);
+        }
+
+    while ((node = sc->retired) != NULL) {
+        sc->retired = node->retired;
+        free(node);
+    }
+
+    pthread_mutex_destroy(&sc->lock);
+    pthread_cond_destroy(&sc->done);
+    free(sc->buckets);
+    free(sc);
+}
+
+
+/* counts of all readers so far, exact only while no thread is reading */
+void sharedcache_stats(struct sharedcache *sc, struct cachestats *st)
+{
+    int i;
+
+    memset(st, 0, sizeof(struct cachestats));
+    for (i = 0; i < SHARED_READERS; i++) {
+        st->hits += sc->readers[i].hits;
+        st->misses += sc->readers[i].misses;
+        st->waits += sc->readers[i].waits;
+    }
+
+    pthread_mutex_lock(&sc->lock);
+    st->evictions = sc->evictions;
+    st->count = sc->count;
+    st->capacity = sc->capacity;
+    pthread_mutex_unlock(&sc->lock);
+}
+
+
+/*
+ * start reading sc from this thread, years missing are computed by engine e,
+ * which is used by this thread only
+ *
+ * Return: NULL if SHARED_READERS threads are reading sc already
+ */
+struct cachereader *cachereader_join(struct sharedcache *sc,
+                                     struct lcengine *e)
+{
+    int i, unused;
+    struct cachereader *r;
+
+    for (i = 0; i < SHARED_READERS; i++) {
+        r = &sc->readers[i];
+        unused = 0;
+        if (__atomic_compare_exchange_n(&r->used, &unused, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            r->cache = sc;
+            r->engine = e;
+            return r;
+        }
+    }
+
+    return NULL;
+}
+
+
+void cachereader_leave(struct cachereader *r)
+{
+    r->engine = NULL;
+    __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+
+/* years found from here to shared_exit() stay valid, do not nest */
+void shared_enter(struct cachereader *r)
+{
+    unsigned long epoch;
+
+    epoch = __atomic_load_n(&r->cache->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->epoch, epoch, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+void shared_exit(struct cachereader *r)
+{
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * the lunar calendar of year, computed by the engine of r if no thread has
+ * done it, with the events of that engine. Engines sharing a cache should
+ * ask for the same events. Only call between shared_enter() and
+ * shared_exit().
+ *
+ * Return: NULL if out of memory
+ */
+const struct lunaryear *shared_lunaryear(struct cachereader *r, int year)
+{
+    int evicted;
+    struct sharednode *node, **b;
+    struct sharedcache *sc = r->cache;
+
+    node = lookup(sc, year);
+    if (node && __atomic_load_n(&node->ready, __ATOMIC_ACQUIRE)) {
+        if (!__atomic_load_n(&node->ref, __ATOMIC_RELAXED))
+            __atomic_store_n(&node->ref, 1, __ATOMIC_RELAXED);
+        r->hits++;
+        return &node->ly;
+    }
+
+    pthread_mutex_lock(&sc->lock);
+    if ((node = lookup(sc, year)) != NULL) {
+        /* another reader is computing it, or has just done */
+        if (node->ready)
+            r->hits++;
+        else
+            r->waits++;
+        while (!node->ready)
+            pthread_cond_wait(&sc->done, &sc->lock);
+        pthread_mutex_unlock(&sc->lock);
+        return &node->ly;
+    }
+
+    node = (struct sharednode *) malloc(sizeof(struct sharednode));
+    if (node == NULL) {
+        pthread_mutex_unlock(&sc->lock);
+        return NULL;
+    }
+
+    node->year = year;
+    node->ready = 0;
+    node->ref = 1;
+    b = shared_bucket(sc, year);
+    node->next = *b;
+    __atomic_store_n(b, node, __ATOMIC_RELEASE);
+    sc->count++;
+
+    evicted = 0;
+    while (sc->count > sc->capacity && evict(sc))
+        evicted++;
+    if (evicted) {
+        __atomic_add_fetch(&sc->epoch, 1, __ATOMIC_SEQ_CST);
+        reclaim(sc);
+    }
+    pthread_mutex_unlock(&sc->lock);
+
+    r->misses++;
+    load_lunaryear(r->engine, &node->ly, year);
+
+    pthread_mutex_lock(&sc->lock);
+    __atomic_store_n(&node->ready, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&sc->done);
+    pthread_mutex_unlock(&sc->lock);
+    return &node->ly;
+}
+
+
+/*
+ * solar2lunar() by the years of the cache of r
+ *
+ * Return: 0 on success, -1 on error
+ */
+int shared_solar2lunar(struct cachereader *r, int year, int month, int day,
+                       struct lunarcal *lc)
+{
+    int jdn, ret;
+    const struct lunaryear *ly;
+
+    if (month < 1 || month > 12 || day < 1 || day > 31)
+        return -1;
+
+    jdn = (int) (g2jd(year, month, day) + 0.5);
+    shared_enter(r);
+
+    /* the year cn_lunarcal() takes the day from, as lunaryear_of() */
+    ly = NULL;
+    if (month >= 11) {
+        ly = shared_lunaryear(r, year + 1);
+        if (ly && jdn < ly->months[0].start)
+            ly = NULL;
+    }
+    if (ly == NULL)
+        ly = shared_lunaryear(r, year);
+
+    ret = ly ? lunaryear_day(ly, r->engine->events_need, jdn, lc) : -1;
+    shared_exit(r);
+    return ret;
+}
@@ -2,11 +2,39 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
 #include "astro.h"
+#include "lunarcalbase.h"
 
 #define MAX_JPL_LINE_LEN 100
 #define MAX_JPL_RECORDS  73415
 #define FLAG_SOE 1
+#define BENCH_EVALS 2000
+#define SOLVER_START 1900
+#define SOLVER_END 2100
+#define SOLVER_YEARS (SOLVER_END - SOLVER_START + 1)
+#define SOLVER_NMS 13   /* new moons searched per year */
+#define CACHE_FIRST 1900
+#define CACHE_LAST 2101   /* December of 2100 is in the model of 2101 */
+#define CACHE_LOOKUPS 1000000   /* lookups by all threads of a pass */
+#define CACHE_THREADS 64
+#define CACHE_DAYS (12 * 28)    /* days of a year cachelookups() asks for */
+#define EVICT_THREADS 8         /* of the pass that evicts, see evictpass() */
+#define EVICT_CAPACITY 4
+#define EVICT_LOOKUPS 4000
+
+/* a thread of benchcache() */
+struct cachejob {
+    int id;
+    int lookups;
+    struct lcengine *e;      /* engine of its own, or shared under lock */
+    pthread_mutex_t *lock;   /* NULL to read the shared cache by r */
+    struct cachereader *r;
+    long sum;                /* of the dates found, to compare passes */
+    const struct lunarcal *expect;   /* solar2lunar() of the dates, or NULL */
+    long wrong;              /* dates that differ from expect */
+};
 
 struct jplrcd {
     double jd;
@@ -18,6 +46,22 @@ struct jplrcd *lon_alloc(void);
 void verify_apparent_sun_moon(void);
 double n180to180(double angle);
 double jd2year(double jd);
+double elapsed_ns(struct timespec *t0, struct timespec *t1);
+void benchlea406(void);
+void benchsolver(void);
+void solverpass(const char *name, int fidelity, int datemode,
+                double nms[][SOLVER_NMS], double sts[][24],
+                const double angles[]);
+int datediffs(double nms[][SOLVER_NMS], double sts[][24],
+              double fnms[][SOLVER_NMS], double fsts[][24]);
+double localdate(double jd);
+void printhist(const char *name, const long hist[]);
+void *cachefill(void *arg);
+void *cachelookups(void *arg);
+double cachepass(struct cachejob *jobs, int nthreads, void *(*fn)(void *),
+                 long *sum);
+void evictpass(struct lcengine *e, struct lcengine **engines);
+void benchcache(void);
 
 double jd2year(double jd)
 {
@@ -162,9 +206,11 @@ struct jplrcd *lon_alloc(void)
 void verify_apparent_sun_moon(void)
 {
     int lensun, lenmoon;
-    int i, step, count;
+    int i, k, n, step, count;
     double delta_sun, delta_moon;
     double delta_sun_n, delta_sun_p, delta_moon_n, delta_moon_p;
+    double jds[EPOCH_BATCH], sun[EPOCH_BATCH], moon[EPOCH_BATCH];
+    int idx[EPOCH_BATCH];
     struct jplrcd *jplsun[MAX_JPL_RECORDS];
     struct jplrcd *jplmoon[MAX_JPL_RECORDS];
 
@@ -178,11 +224,21 @@ void verify_apparent_sun_moon(void)
     delta_moon_n = 0;
     delta_moon_p = 0;
     while (i < lensun) {
-        if (jplsun[i]->jd == jplmoon[i]->jd) {
-            delta_sun = n180to180(apparentsun(jplsun[i]->jd, 0) * RAD2DEG
-                                    - jplsun[i]->lon) * 3600;
-            delta_moon = n180to180(apparentmoon(jplmoon[i]->jd, 0) * RAD2DEG
-                                 - jplmoon[i]->lon) * 3600;
+        /* collect a batch of records where Sun and Moon share the epoch */
+        for (n = 0; n < EPOCH_BATCH && i < lensun; i += step) {
+            if (jplsun[i]->jd == jplmoon[i]->jd) {
+                idx[n] = i;
+                jds[n++] = jplsun[i]->jd;
+            }
+        }
+
+        apparentsun_batch(jds, n, sun, 0);
+        apparentmoon_batch(jds, n, moon, 0);
+        for (k = 0; k < n; k++) {
+            delta_sun = n180to180(sun[k] * RAD2DEG
+                                    - jplsun[idx[k]]->lon) * 3600;
+            delta_moon = n180to180(moon[k] * RAD2DEG
+                                 - jplmoon[idx[k]]->lon) * 3600;
             if (delta_sun > 0)
                 delta_sun_p += delta_sun;
             else
@@ -195,9 +251,8 @@ void verify_apparent_sun_moon(void)
             count++;
 
             printf("%.2f  %.9f  %.9f\n",
-                    jd2year(jplsun[i]->jd), delta_moon, delta_sun);
+                    jd2year(jds[k]), delta_moon, delta_sun);
         }
-        i += step;
     }
 
     printf("\n# total records of JPL Sun = %d Moon=%d\n", lensun, lenmoon);
@@ -207,6 +262,397 @@ void verify_apparent_sun_moon(void)
                                 delta_moon_p / count, delta_moon_n / count);
 }
 
+double elapsed_ns(struct timespec *t0, struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+
+/* report the latency of a full LEA-406 evaluation, one by one and batched,
+ * for every term kernel this CPU supports */
+void benchlea406(void)
+{
+    int i, k;
+    double jd, sum, maxdiff;
+    static double jds[BENCH_EVALS], out[BENCH_EVALS], ref[BENCH_EVALS];
+    struct timespec t0, t1;
+    const char *kernels[] = {"scalar", "sse2", "avx2", "avx512"};
+    const char *name;
+
+    for (i = 0; i < BENCH_EVALS; i++)
+        jds[i] = J2000 + i * 0.37;
+
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if ((name = lea406_use_kernel(kernels[k])) == NULL) {
+            printf("# %-6s: not supported\n", kernels[k]);
+            continue;
+        }
+
+        /* warm up, the first call may start worker threads */
+        sum = apparentmoon(J2000, 1);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < BENCH_EVALS; i++) {
+            jd = J2000 + i * 0.37;
+            sum += apparentmoon(jd, 1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        printf("# %-6s: lea406 %.0f ns per evaluation",
+               name, elapsed_ns(&t0, &t1) / BENCH_EVALS);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        lea406_batch(jds, BENCH_EVALS, out);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        if (k == 0)
+            memcpy(ref, out, sizeof(out));
+
+        maxdiff = 0;
+        for (i = 0; i < BENCH_EVALS; i++)
+            if (fabs(out[i] - ref[i]) > maxdiff)
+                maxdiff = fabs(out[i] - ref[i]);
+
+        printf(", lea406_batch %.0f ns per epoch, max diff to scalar %.3g rad\n",
+               elapsed_ns(&t0, &t1) / BENCH_EVALS, maxdiff);
+    }
+
+    lea406_use_kernel("best");
+}
+
+
+/* find the new moons and solar terms of SOLVER_START - SOLVER_END with the
+ * given fidelity, only exact to the date in UTC+8 if datemode is set. Report
+ * the evaluations per event */
+void solverpass(const char *name, int fidelity, int datemode,
+                double nms[][SOLVER_NMS], double sts[][24],
+                const double angles[])
+{
+    int y;
+    struct solverstats nm, st;
+    struct timespec t0, t1;
+
+    set_fidelity(fidelity);
+    reset_solverstats();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (y = 0; y < SOLVER_YEARS; y++) {
+        if (datemode) {
+            findnewmoons_date(nms[y], SOLVER_NMS, g2jd(SOLVER_START + y, 1, 1),
+                              8);
+            findsolarterms_date(sts[y], angles, 24, SOLVER_START + y, 8);
+        } else {
+            findnewmoons(nms[y], SOLVER_NMS, g2jd(SOLVER_START + y, 1, 1));
+            findsolarterms(sts[y], angles, 24, SOLVER_START + y);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    get_solverstats(&nm, &st);
+    printf("# %-6s: evaluations per event, full + low fidelity, "
+           "newmoon %.2f + %.2f, solarterm %.2f + %.2f, %.1f ms\n", name,
+           (double) nm.evals / nm.events, (double) nm.lowevals / nm.events,
+           (double) st.evals / st.events, (double) st.lowevals / st.events,
+           elapsed_ns(&t0, &t1) / 1e6);
+    printf("#         refined on the full series: %ld of %ld new moons, "
+           "%ld of %ld solar terms\n", nm.refined, nm.events, st.refined,
+           st.events);
+    printhist("newmoon", nm.hist);
+    printhist("solarterm", st.hist);
+    set_fidelity(FIDELITY_MULTI);
+}
+
+
+/* print the histogram of evaluations per event of a search */
+void printhist(const char *name, const long hist[])
+{
+    int i;
+
+    printf("#         %-9s evaluations:", name);
+    for (i = 1; i < SOLVER_HIST; i++)
+        printf(" %d%s: %ld", i, (i == SOLVER_HIST - 1) ? "+" : "", hist[i]);
+    printf("\n");
+}
+
+
+/* the date in UTC+8 of a JDTT, as the calendar takes it */
+double localdate(double jd)
+{
+    GregorianDate g = jd2g(jd);
+    return floor(jd + 0.5 + (8 * 3600.0 - deltaT(g.year, g.month)) / 86400.0);
+}
+
+
+/* count the events of two passes that fall on different dates in UTC+8 */
+int datediffs(double nms[][SOLVER_NMS], double sts[][24],
+              double fnms[][SOLVER_NMS], double fsts[][24])
+{
+    int i, y, dates;
+
+    dates = 0;
+    for (y = 0; y < SOLVER_YEARS; y++) {
+        for (i = 0; i < SOLVER_NMS; i++)
+            dates += (localdate(nms[y][i]) != localdate(fnms[y][i]));
+        for (i = 0; i < 24; i++)
+            dates += (localdate(sts[y][i]) != localdate(fsts[y][i]));
+    }
+    return dates;
+}
+
+
+/* compare the function evaluations per event of the multi-fidelity and the
+ * full fidelity Newton search, and the Secand search used before, over
+ * SOLVER_START - SOLVER_END */
+void benchsolver(void)
+{
+    int year, i, y, dates;
+    double est, x0, jd, nmdiff, stdiff;
+    static double nms[SOLVER_YEARS][SOLVER_NMS], sts[SOLVER_YEARS][24];
+    static double fnms[SOLVER_YEARS][SOLVER_NMS], fsts[SOLVER_YEARS][24];
+    double angles[24];
+    struct solverstats nm, st;
+    struct timespec t0, t1;
+
+    for (i = 0; i < 24; i++)
+        angles[i] = -120 + i * 15;
+
+    solverpass("full", FIDELITY_FULL, 0, fnms, fsts, angles);
+    solverpass("multi", FIDELITY_MULTI, 0, nms, sts, angles);
+
+    nmdiff = stdiff = 0;
+    for (y = 0; y < SOLVER_YEARS; y++) {
+        for (i = 0; i < SOLVER_NMS; i++)
+            nmdiff = fmax(nmdiff, fabs(nms[y][i] - fnms[y][i]));
+        for (i = 0; i < 24; i++)
+            stdiff = fmax(stdiff, fabs(sts[y][i] - fsts[y][i]));
+    }
+    dates = datediffs(nms, sts, fnms, fsts);
+    printf("# max diff multi to full: newmoon %.4f s, solarterm %.4f s, "
+           "%d local dates differ\n", nmdiff * 86400, stdiff * 86400, dates);
+
+    solverpass("date", FIDELITY_MULTI, 1, nms, sts, angles);
+    printf("# %d local dates differ from full\n",
+           datediffs(nms, sts, fnms, fsts));
+
+    /* the Secand search and seeding the calendar used before */
+    reset_solverstats();
+    nmdiff = stdiff = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (y = 0; y < SOLVER_YEARS; y++) {
+        year = SOLVER_START + y;
+        for (i = 0; i < SOLVER_NMS; i++) {
+            est = fnms[y][0] + i * SYNODIC_MONTH;
+            x0 = est - f_msangle(est, 0) / MOON_SPEED;
+            jd = rootbysecand(f_msangle, 0, x0, x0 + 0.5, 0.0000001);
+            nmdiff = fmax(nmdiff, fabs(jd - fnms[y][i]));
+        }
+        for (i = 0; i < 24; i++) {
+            x0 = g2jd(year, 3, 20.5) + angles[i] * 360.0 / 365.24;
+            jd = rootbysecand(f_solarangle, angles[i] * DEG2RAD, x0, x0 + 0.5,
+                              0.000000005);
+            stdiff = fmax(stdiff, fabs(jd - fsts[y][i]));
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    get_solverstats(&nm, &st);
+    printf("# secand: evaluations per event, newmoon %.2f, solarterm %.2f, "
+           "%.1f ms\n", (double) nm.evals / (SOLVER_YEARS * SOLVER_NMS),
+           (double) st.evals / (SOLVER_YEARS * 24),
+           elapsed_ns(&t0, &t1) / 1e6);
+    printf("# max diff secand to full: newmoon %.4f s, solarterm %.4f s\n",
+           nmdiff * 86400, stdiff * 86400);
+}
+
+
+/* every year of the range once, each thread starting at a different year */
+void *cachefill(void *arg)
+{
+    int i, n;
+    struct lunarcal lc;
+    struct cachejob *job = (struct cachejob *) arg;
+
+    n = CACHE_LAST - CACHE_FIRST + 1;
+    for (i = 0; i < n; i++)
+        shared_solar2lunar(job->r, CACHE_FIRST + (job->id * 7 + i) % n, 6, 1,
+                           &lc);
+    return NULL;
+}
+
+
+/*
+ * random dates of the range, under lock or from the shared cache, checked
+ * against job->expect if given
+ */
+void *cachelookups(void *arg)
+{
+    int i, year, month, day;
+    unsigned int seed;
+    struct lunarcal lc;
+    const struct lunarcal *x;
+    struct cachejob *job = (struct cachejob *) arg;
+
+    seed = job->id + 1;
+    job->sum = 0;
+    job->wrong = 0;
+    for (i = 0; i < job->lookups; i++) {
+        year = CACHE_FIRST + rand_r(&seed) % (CACHE_LAST - CACHE_FIRST);
+        month = 1 + rand_r(&seed) % 12;
+        day = 1 + rand_r(&seed) % 28;
+        if (job->lock) {
+            pthread_mutex_lock(job->lock);
+            solar2lunar(job->e, year, month, day, &lc);
+            pthread_mutex_unlock(job->lock);
+        } else {
+            shared_solar2lunar(job->r, year, month, day, &lc);
+        }
+        job->sum += lc.lyear * 400 + lc.month * 31 + lc.day;
+
+        if (job->expect == NULL)
+            continue;
+        x = &job->expect[(year - CACHE_FIRST) * CACHE_DAYS + (month - 1) * 28
+                         + day - 1];
+        if (lc.jdn != x->jdn || lc.lyear != x->lyear || lc.month != x->month
+            || lc.day != x->day || lc.is_lm != x->is_lm
+            || lc.solarterm != x->solarterm || lc.holiday != x->holiday)
+            job->wrong++;
+    }
+    return NULL;
+}
+
+
+/* run fn in nthreads threads, return the ns it took */
+double cachepass(struct cachejob *jobs, int nthreads, void *(*fn)(void *),
+                 long *sum)
+{
+    int i;
+    pthread_t tids[CACHE_THREADS];
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&tids[i], NULL, fn, &jobs[i]);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    *sum = 0;
+    for (i = 0; i < nthreads; i++)
+        *sum += jobs[i].sum;
+    return elapsed_ns(&t0, &t1);
+}
+
+
+/*
+ * EVICT_THREADS threads on a shared cache of EVICT_CAPACITY years, so that
+ * nearly every lookup evicts a year other threads may still be reading.
+ * Every date is checked against solar2lunar() by engine e.
+ */
+void evictpass(struct lcengine *e, struct lcengine **engines)
+{
+    int i, y, m, d;
+    long sum, wrong;
+    double ns;
+    struct lunarcal *expect, *x;
+    struct sharedcache *sc;
+    struct cachestats st;
+    struct cachejob jobs[EVICT_THREADS];
+
+    expect = (struct lunarcal *) malloc((CACHE_LAST - CACHE_FIRST)
+                                        * CACHE_DAYS * sizeof(*expect));
+    for (y = CACHE_FIRST, x = expect; y < CACHE_LAST; y++)
+        for (m = 1; m <= 12; m++)
+            for (d = 1; d <= 28; d++)
+                solar2lunar(e, y, m, d, x++);
+
+    sc = sharedcache_alloc(EVICT_CAPACITY);
+    memset(jobs, 0, sizeof(jobs));
+    for (i = 0; i < EVICT_THREADS; i++) {
+        jobs[i].id = i;
+        jobs[i].lookups = EVICT_LOOKUPS / EVICT_THREADS;
+        jobs[i].r = cachereader_join(sc, engines[i]);
+        jobs[i].expect = expect;
+    }
+
+    ns = cachepass(jobs, EVICT_THREADS, cachelookups, &sum);
+    for (i = 0, wrong = 0; i < EVICT_THREADS; i++) {
+        wrong += jobs[i].wrong;
+        cachereader_leave(jobs[i].r);
+    }
+
+    sharedcache_stats(sc, &st);
+    printf("# evicting: %d threads, capacity %d, %ld computed, %ld evicted, "
+           "%ld wrong, %.0f ms\n", EVICT_THREADS, EVICT_CAPACITY, st.misses,
+           st.evictions, wrong, ns / 1e6);
+
+    sharedcache_free(sc);
+    free(expect);
+}
+
+
+/* date conversion from 1 to CACHE_THREADS threads, by one engine under a
+ * mutex and by engines sharing a lock-free cache */
+void benchcache(void)
+{
+    int i, n, years;
+    long sum1, sum2;
+    double ns1, ns2;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    struct lcengine *shared, *engines[CACHE_THREADS];
+    struct sharedcache *sc;
+    struct cachestats st;
+    struct cachejob jobs[CACHE_THREADS];
+
+    years = CACHE_LAST - CACHE_FIRST + 1;
+    shared = lcengine_alloc();
+    set_cachesize(shared, years);
+    sc = sharedcache_alloc(years);
+
+    memset(jobs, 0, sizeof(jobs));
+    for (i = 0; i < CACHE_THREADS; i++) {
+        engines[i] = lcengine_alloc();
+        jobs[i].id = i;
+        jobs[i].r = cachereader_join(sc, engines[i]);
+    }
+
+    /* all threads ask for every year at once, each must be computed once */
+    ns1 = cachepass(jobs, CACHE_THREADS, cachefill, &sum1);
+    sharedcache_stats(sc, &st);
+    printf("# cold: %d threads, %d years, %ld computed, %ld waited, "
+           "%.0f ms\n", CACHE_THREADS, years, st.misses, st.waits, ns1 / 1e6);
+
+    for (i = CACHE_FIRST; i <= CACHE_LAST; i++)
+        get_lunaryear(shared, i);
+
+    for (n = 1; n <= CACHE_THREADS; n *= 2) {
+        for (i = 0; i < n; i++) {
+            jobs[i].lookups = CACHE_LOOKUPS / n;
+            jobs[i].e = shared;
+            jobs[i].lock = &lock;
+        }
+        ns1 = cachepass(jobs, n, cachelookups, &sum1);
+
+        for (i = 0; i < n; i++)
+            jobs[i].lock = NULL;
+        ns2 = cachepass(jobs, n, cachelookups, &sum2);
+
+        printf("# %2d threads: mutex %4.0f ns, shared %4.0f ns per lookup%s\n",
+               n, ns1 / (n * jobs[0].lookups), ns2 / (n * jobs[0].lookups),
+               (sum1 == sum2) ? "" : ", results differ");
+    }
+
+    sharedcache_stats(sc, &st);
+    printf("# shared cache: %ld hits, %ld computed, %ld evicted\n", st.hits,
+           st.misses, st.evictions);
+
+    evictpass(shared, engines);
+
+    for (i = 0; i < CACHE_THREADS; i++) {
+        cachereader_leave(jobs[i].r);
+        lcengine_free(engines[i]);
+    }
+    sharedcache_free(sc);
+    lcengine_free(shared);
+}
+
+
 double n180to180(double angle)
 {
     angle = fmod(angle, 360.0);
@@ -217,12 +663,32 @@ double n180to180(double angle)
     return angle;
 }
 
-int main(void);
-int main()
+int main(int argc, char *argv[])
 {
     //testnewmoon_solarterm();
     //testapparentmoon();
     //testnutation();
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        benchlea406();
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "solver") == 0) {
+        benchsolver();
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "cache") == 0) {
+        benchcache();
+        return 0;
+    }
+
+    /* optionally verify a given LEA-406 term kernel, e.g. testastro scalar */
+    if (argc > 1 && lea406_use_kernel(argv[1]) == NULL) {
+        printf("kernel %s is not supported\n", argv[1]);
+        return 2;
+    }
+
     verify_apparent_sun_moon();
     return 0;
 }
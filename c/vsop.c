@@ -10,7 +10,9 @@ Reference:
 */
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "astro.h"
 
 
@@ -658,6 +660,46 @@ double vsopLx(double vsopterms[][3], size_t rowcount, double t)
 }
 
 
+/* batch version of vsopLx, rows are the outer loop so each row is loaded
+ * once for all n values of t */
+void vsopLx_batch(double vsopterms[][3], size_t rowcount, const double *t,
+                  size_t n, double *out)
+{
+    vsopLx_rate_batch(vsopterms, rowcount, t, n, out, NULL);
+}
+
+
+/* vsopLx_batch that also gives d/dt if rate is not NULL */
+void vsopLx_rate_batch(double vsopterms[][3], size_t rowcount,
+                       const double *t, size_t n, double *out, double *rate)
+{
+    size_t i, k;
+    double arg;
+
+    for (k = 0; k < n; k++) {
+        out[k] = 0;
+        if (rate)
+            rate[k] = 0;
+    }
+
+    if (rate == NULL) {
+        for (i = 0; i < rowcount; i++)
+            for (k = 0; k < n; k++)
+                out[k] += vsopterms[i][0] * cos(vsopterms[i][1]
+                                                + vsopterms[i][2] * t[k]);
+        return;
+    }
+
+    for (i = 0; i < rowcount; i++) {
+        for (k = 0; k < n; k++) {
+            arg = vsopterms[i][1] + vsopterms[i][2] * t[k];
+            out[k] += vsopterms[i][0] * cos(arg);
+            rate[k] -= vsopterms[i][0] * vsopterms[i][2] * sin(arg);
+        }
+    }
+}
+
+
 /* Calculate ecliptical longitude of earth in heliocentric coordinates,
  * use VSOP87D table, heliocentric spherical, coordinates referred to the mean
  * equinox of the date,
@@ -695,6 +737,115 @@ double vsop(double jd)
     return lon;
 }
 
+/* vsop for n epochs, gives the same results as calling vsop n times */
+void vsop_batch(const double *jd, size_t n, double *out)
+{
+    vsop_rate_batch(jd, n, out, NULL);
+}
+
+
+/*
+ * sum the series L0 - L5 and the rate in radians per day for n epochs, the
+ * rate is skipped if it is NULL
+ */
+static void vsop_series_rate_batch(double (*series[6])[3],
+                                   const size_t count[6], const double *jd,
+                                   size_t n, double *out, double *rate)
+{
+    int i;
+    size_t k, m;
+    double t[EPOCH_BATCH];
+    double L[6][EPOCH_BATCH], D[6][EPOCH_BATCH];
+
+    while (n > 0) {
+        m = (n > EPOCH_BATCH) ? EPOCH_BATCH : n;
+        for (k = 0; k < m; k++)
+            t[k] = (jd[k] - J2000) / 365250.0;
+
+        for (i = 0; i < 6; i++)
+            vsopLx_rate_batch(series[i], count[i], t, m, L[i],
+                              (rate) ? D[i] : NULL);
+
+        for (k = 0; k < m; k++) {
+            out[k] = (L[0][k] + t[k] * (L[1][k] + t[k] * (L[2][k] + t[k]
+                      * (L[3][k] + t[k] * (L[4][k] + t[k] * L[5][k])))));
+            /* adjust FK5  */
+            out[k] += -4.379321981462438e-07;
+        }
+
+        if (rate) {
+            /* d/dt of sum Lk t^k, t in millennium */
+            for (k = 0; k < m; k++) {
+                rate[k] = (D[0][k] + t[k] * (D[1][k] + t[k] * (D[2][k] + t[k]
+                           * (D[3][k] + t[k] * (D[4][k] + t[k] * D[5][k])))))
+                          + (L[1][k] + t[k] * (2 * L[2][k] + t[k] * (3 * L[3][k]
+                             + t[k] * (4 * L[4][k] + t[k] * 5 * L[5][k]))));
+                rate[k] /= 365250.0;
+            }
+            rate += m;
+        }
+
+        jd += m;
+        out += m;
+        n -= m;
+    }
+}
+
+
+/* the VSOP87D tables in use */
+static double (*full_series[6])[3] = {
+    earth_L0, earth_L1, earth_L2, earth_L3, earth_L4, earth_L5,
+};
+static const size_t full_count[6] = {
+    sizeof(earth_L0) / 24, sizeof(earth_L1) / 24, sizeof(earth_L2) / 24,
+    sizeof(earth_L3) / 24, sizeof(earth_L4) / 24, sizeof(earth_L5) / 24,
+};
+
+/*
+ * The low fidelity tables keep only the rows of amplitude at least
+ * VSOP_LOW_MIN radians, about a third of the rows. They are built once on
+ * first use.
+ */
+static double low_rows[172 + 165 + 93 + 8 + 4 + 4][3];
+static double (*low_series[6])[3];
+static size_t low_count[6];
+static pthread_once_t low_once = PTHREAD_ONCE_INIT;
+
+static void vsop_low_init(void)
+{
+    int i;
+    size_t j, used;
+
+    used = 0;
+    for (i = 0; i < 6; i++) {
+        low_series[i] = low_rows + used;
+        for (j = 0; j < full_count[i]; j++) {
+            if (fabs(full_series[i][j][0]) < VSOP_LOW_MIN)
+                continue;
+            memcpy(low_rows[used], full_series[i][j], sizeof(low_rows[0]));
+            used++;
+        }
+        low_count[i] = low_rows + used - low_series[i];
+    }
+}
+
+
+/* vsop_batch that also gives the rate in radians per day if rate is not
+ * NULL */
+void vsop_rate_batch(const double *jd, size_t n, double *out, double *rate)
+{
+    vsop_series_rate_batch(full_series, full_count, jd, n, out, rate);
+}
+
+
+/* vsop_rate_batch by the low fidelity tables */
+void vsop_low_rate_batch(const double *jd, size_t n, double *out,
+                         double *rate)
+{
+    pthread_once(&low_once, vsop_low_init);
+    vsop_series_rate_batch(low_series, low_count, jd, n, out, rate);
+}
+
 /* calculate the apprent place of the Sun.
  * Arg:
  *     jd as jd
@@ -714,3 +865,48 @@ double apparentsun(double jd, int ignorenutation)
     geolon += lightabbr_high(jd);
     return geolon;
 }
+
+/* apparent place of the Sun for n epochs */
+void apparentsun_batch(const double *jd, size_t n, double *out,
+                       int ignorenutation)
+{
+    apparentsun_rate_batch(jd, n, out, NULL, ignorenutation);
+}
+
+
+/*
+ * apparent place of the Sun and its rate in radians per day for n epochs.
+ * The rates of nutation and aberration are less than 1e-4 of the Sun's and
+ * are left out.
+ */
+void apparentsun_rate_batch(const double *jd, size_t n, double *out,
+                            double *rate, int ignorenutation)
+{
+    size_t k;
+
+    vsop_rate_batch(jd, n, out, rate);
+    for (k = 0; k < n; k++) {
+        out[k] += PI;
+        if (!ignorenutation)
+            out[k] += nutation(jd[k]);
+
+        out[k] += lightabbr_high(jd[k]);
+    }
+}
+
+
+/* apparentsun_rate_batch by the low fidelity VSOP87D tables */
+void apparentsun_low_rate_batch(const double *jd, size_t n, double *out,
+                                double *rate, int ignorenutation)
+{
+    size_t k;
+
+    vsop_low_rate_batch(jd, n, out, rate);
+    for (k = 0; k < n; k++) {
+        out[k] += PI;
+        if (!ignorenutation)
+            out[k] += nutation(jd[k]);
+
+        out[k] += lightabbr_high(jd[k]);
+    }
+}
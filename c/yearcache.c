@@ -0,0 +1,204 @@
+/*
+ copyright 2020, Chen Wei <weichen302@gmail.com>
+ version 0.0.3
+Cache of lunar years of an engine.
+
+Years are found by a hash on the year number and kept in a list from the
+most to the least recently used. When the cache is full the least recently
+used year is evicted and freed. The capacity is set by years or by a memory
+budget, and never goes below CACHE_MIN since cn_lunarcal() holds two years
+at a time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "astro.h"
+#include "lunarcalbase.h"
+
+
+/* bucket of year, consecutive years go to consecutive buckets */
+static struct yearnode **bucket(struct yearcache *c, int year)
+{
+    return &c->buckets[(unsigned int) year & (c->nbuckets - 1)];
+}
+
+
+static void lru_unlink(struct yearcache *c, struct yearnode *node)
+{
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        c->mru = node->next;
+
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        c->lru = node->prev;
+}
+
+
+static void lru_push(struct yearcache *c, struct yearnode *node)
+{
+    node->prev = NULL;
+    node->next = c->mru;
+    if (c->mru)
+        c->mru->prev = node;
+    else
+        c->lru = node;
+    c->mru = node;
+}
+
+
+/* empty cache of CACHESIZE years */
+int init_cache(struct lcengine *e)
+{
+    memset(&e->cache, 0, sizeof(struct yearcache));
+    return set_cachesize(e, CACHESIZE);
+}
+
+
+void free_cache(struct lcengine *e)
+{
+    while (e->cache.lru)
+        evict_cache(e);
+
+    free(e->cache.buckets);
+    e->cache.buckets = NULL;
+}
+
+
+/*
+ * keep at most capacity years, the least recently used ones are evicted if
+ * there are more
+ *
+ * Return: 0 on success, -1 if out of memory, the cache is unchanged then
+ */
+int set_cachesize(struct lcengine *e, int capacity)
+{
+    int i, n, k;
+    struct yearnode **buckets, *node;
+    struct yearcache *c = &e->cache;
+
+    capacity = (capacity < CACHE_MIN) ? CACHE_MIN : capacity;
+    for (n = 1; n < capacity; n *= 2)
+        ;
+
+    if (n != c->nbuckets) {
+        buckets = (struct yearnode **) calloc(n, sizeof(struct yearnode *));
+        if (buckets == NULL)
+            return -1;
+
+        for (i = 0; i < c->nbuckets; i++)
+            while ((node = c->buckets[i]) != NULL) {
+                c->buckets[i] = node->hnext;
+                k = (unsigned int) node->ly.year & (n - 1);
+                node->hnext = buckets[k];
+                buckets[k] = node;
+            }
+
+        free(c->buckets);
+        c->buckets = buckets;
+        c->nbuckets = n;
+    }
+
+    c->stats.capacity = capacity;
+    while (c->stats.count > capacity)
+        evict_cache(e);
+
+    return 0;
+}
+
+
+/* keep as many years as fit in bytes */
+int set_cachebudget(struct lcengine *e, size_t bytes)
+{
+    size_t n;
+
+    /* a node and its share of the buckets */
+    n = bytes / (sizeof(struct yearnode) + 2 * sizeof(struct yearnode *));
+    return set_cachesize(e, (n > 1 << 20) ? 1 << 20 : (int) n);
+}
+
+
+void get_cachestats(struct lcengine *e, struct cachestats *st)
+{
+    *st = e->cache.stats;
+}
+
+
+/*
+ * year in cache, it becomes the most recently used
+ *
+ * Return: NULL if year is not in cache
+ */
+struct lunaryear *cache_find(struct lcengine *e, int year)
+{
+    struct yearnode *node;
+    struct yearcache *c = &e->cache;
+
+    for (node = *bucket(c, year); node; node = node->hnext)
+        if (node->ly.year == year)
+            break;
+
+    if (node == NULL) {
+        c->stats.misses++;
+        return NULL;
+    }
+
+    c->stats.hits++;
+    if (node != c->mru) {
+        lru_unlink(c, node);
+        lru_push(c, node);
+    }
+    return &node->ly;
+}
+
+
+/*
+ * add year to cache as the most recently used, the least recently used year
+ * is evicted if the cache is full. The caller fills in the year, which must
+ * keep ly->year.
+ *
+ * Return: NULL if out of memory
+ */
+struct lunaryear *cache_add(struct lcengine *e, int year)
+{
+    struct yearnode *node, **b;
+    struct yearcache *c = &e->cache;
+
+    if (c->stats.count >= c->stats.capacity)
+        evict_cache(e);
+
+    node = (struct yearnode *) malloc(sizeof(struct yearnode));
+    if (node == NULL)
+        return NULL;
+
+    node->ly.year = year;
+    b = bucket(c, year);
+    node->hnext = *b;
+    *b = node;
+    lru_push(c, node);
+    c->stats.count++;
+    return &node->ly;
+}
+
+
+/* remove and free the least recently used year */
+void evict_cache(struct lcengine *e)
+{
+    struct yearnode *node, **p;
+    struct yearcache *c = &e->cache;
+
+    if ((node = c->lru) == NULL)
+        return;
+
+    for (p = bucket(c, node->ly.year); *p != node; p = &(*p)->hnext)
+        ;
+    *p = node->hnext;
+
+    lru_unlink(c, node);
+    free(node);
+    c->stats.count--;
+    c->stats.evictions++;
+}